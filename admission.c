@@ -0,0 +1,190 @@
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+
+int init_admission_table(AdmissionTable *table, unsigned int max_connections_per_ip, unsigned int accept_rate, unsigned int accept_burst)
+{
+    // All entries are allocated up front so that admission never allocates while under a flood
+    if ((table->entries = (AdmissionEntry *)calloc(ADMISSION_TABLE_SIZE, sizeof(AdmissionEntry))) == NULL)
+    {
+        return -1;
+    }
+    table->mask = ADMISSION_TABLE_SIZE - 1;
+    table->max_connections_per_ip = max_connections_per_ip;
+    table->accept_rate = accept_rate;
+    table->accept_burst = accept_burst;
+
+    // A random seed keeps peers from choosing addresses that collide in the table
+    if (getrandom(&table->seed, sizeof(table->seed), GRND_NONBLOCK) != sizeof(table->seed))
+    {
+        table->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    }
+    return 0;
+}
+
+/**
+ * @brief Build the table key for a peer address.
+ *
+ * @param[in] addr The peer address returned by accept().
+ * @param[out] key The 16-byte key.
+ * @return The status of the process.
+ * @retval 0 The key was built.
+ * @retval -1 The address family is not supported.
+ */
+static int make_key(const struct sockaddr_storage *addr, unsigned char key[16])
+{
+    memset(key, 0, 16);
+    if (addr->ss_family == PF_INET)
+    {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)addr;
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &addr4->sin_addr, 4);
+        return 0;
+    }
+    if (addr->ss_family == PF_INET6)
+    {
+        // A single host usually owns a whole /64, so limit by prefix rather than by address
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+        memcpy(key, &addr6->sin6_addr, 8);
+        return 0;
+    }
+    return -1;
+}
+
+static unsigned int hash_key(const unsigned char key[16], unsigned int seed)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261U ^ seed;
+    for (int i = 0; i < 16; i++)
+    {
+        hash ^= key[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find the entry for a key within its probe window.
+ *
+ * Entries are never emptied, only reused in place once idle, so an empty slot ends the search.
+ *
+ * @param[in] table The admission table.
+ * @param[in] key The key to look up.
+ * @param[out] reusable The first empty or idle slot in the window, or NULL if there is none.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return The entry for the key, or NULL if it is not in the table.
+ */
+static AdmissionEntry *lookup_entry(AdmissionTable *table, const unsigned char key[16], AdmissionEntry **reusable, long long now_ms)
+{
+    unsigned int index = hash_key(key, table->seed);
+    if (reusable != NULL)
+    {
+        *reusable = NULL;
+    }
+
+    for (int i = 0; i < ADMISSION_MAX_PROBES; i++)
+    {
+        AdmissionEntry *entry = &table->entries[(index + i) & table->mask];
+        if (!entry->in_use)
+        {
+            if (reusable != NULL && *reusable == NULL)
+            {
+                *reusable = entry;
+            }
+            return NULL;
+        }
+        if (memcmp(entry->addr, key, 16) == 0)
+        {
+            return entry;
+        }
+        // An entry without connections whose bucket is full again carries no state worth keeping
+        if (reusable != NULL && *reusable == NULL && entry->connections == 0 &&
+            (table->accept_rate == 0 || token_bucket_refill(&entry->accept_bucket, table->accept_rate, table->accept_burst, now_ms) >= table->accept_burst))
+        {
+            *reusable = entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Decide whether a newly accepted peer may keep its connection.
+ *
+ * @param[in] table The admission table.
+ * @param[in] addr The peer address returned by accept().
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return The admission decision.
+ * @retval 1 The connection is admitted and counted against the peer, it must be released on close.
+ * @retval 0 The connection is admitted without being counted, it must not be released.
+ * @retval -1 The connection must be closed.
+ */
+int admission_acquire(AdmissionTable *table, const struct sockaddr_storage *addr, long long now_ms)
+{
+    // Without limits there is nothing to track, so the connection is admitted uncounted
+    if (table->max_connections_per_ip == 0 && table->accept_rate == 0)
+    {
+        return 0;
+    }
+
+    unsigned char key[16];
+    if (make_key(addr, key) == -1)
+    {
+        return 0;
+    }
+
+    AdmissionEntry *reusable;
+    AdmissionEntry *entry = lookup_entry(table, key, &reusable, now_ms);
+    if (entry == NULL)
+    {
+        // The probe window is full of active peers, refuse rather than evict their state
+        if (reusable == NULL)
+        {
+            return -1;
+        }
+        entry = reusable;
+        memcpy(entry->addr, key, 16);
+        entry->in_use = 1;
+        entry->connections = 0;
+        token_bucket_init(&entry->accept_bucket, table->accept_burst, now_ms);
+    }
+
+    if (table->max_connections_per_ip != 0 && entry->connections >= table->max_connections_per_ip)
+    {
+        return -1;
+    }
+    if (token_bucket_refill(&entry->accept_bucket, table->accept_rate, table->accept_burst, now_ms) < 1)
+    {
+        return -1;
+    }
+    token_bucket_take(&entry->accept_bucket, 1);
+    entry->connections++;
+    return 1;
+}
+
+void admission_release(AdmissionTable *table, const struct sockaddr_storage *addr)
+{
+    unsigned char key[16];
+    if (make_key(addr, key) == -1)
+    {
+        return;
+    }
+
+    AdmissionEntry *entry = lookup_entry(table, key, NULL, 0);
+    if (entry != NULL && entry->connections > 0)
+    {
+        entry->connections--;
+    }
+}
+
+void free_admission_table(AdmissionTable *table)
+{
+    free(table->entries);
+    table->entries = NULL;
+}
@@ -0,0 +1,34 @@
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "token_bucket.h"
+
+#define ADMISSION_TABLE_SIZE 4096 // Must be a power of two
+#define ADMISSION_MAX_PROBES 8
+
+typedef struct
+{
+    unsigned char addr[16]; // IPv4 addresses are stored IPv4-mapped, IPv6 addresses by their /64 prefix
+    unsigned short in_use;
+    unsigned short connections;
+    TokenBucket accept_bucket;
+} AdmissionEntry;
+
+typedef struct
+{
+    AdmissionEntry *entries;
+    unsigned int mask;
+    unsigned int seed;
+    unsigned int max_connections_per_ip; // 0 for unlimited
+    unsigned int accept_rate;            // Accepts per second per IP, 0 for unlimited
+    unsigned int accept_burst;
+} AdmissionTable;
+
+int init_admission_table(AdmissionTable *table, unsigned int max_connections_per_ip, unsigned int accept_rate, unsigned int accept_burst);
+int admission_acquire(AdmissionTable *table, const struct sockaddr_storage *addr, long long now_ms);
+void admission_release(AdmissionTable *table, const struct sockaddr_storage *addr);
+void free_admission_table(AdmissionTable *table);
+#endif
@@ -0,0 +1,217 @@
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "task_queue.h"
+#include "utils.h"
+
+#define DEFAULT_PRODUCERS 4
+#define DEFAULT_TASKS 1000000 // Per producer
+#define TASK_WINDOW 4096      // Tasks a producer may have queued at once
+
+typedef struct
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong completed; // Written by the consumer
+    _Alignas(CACHE_LINE_SIZE) TaskQueue *queue;
+    Task *nodes;
+    unsigned long tasks;
+    bool allocate;
+    pthread_t thread;
+} Producer;
+
+typedef struct
+{
+    Task task;
+    Producer *producer;
+} AllocatedTask;
+
+static void count_task(void *arg)
+{
+    Producer *producer = (Producer *)arg;
+    atomic_fetch_add_explicit(&producer->completed, 1, memory_order_release);
+}
+
+static void count_allocated_task(void *arg)
+{
+    AllocatedTask *allocated = (AllocatedTask *)arg;
+    count_task(allocated->producer);
+    free(allocated);
+}
+
+/**
+ * @brief Submit tasks as fast as the consumer runs them.
+ *
+ * Tasks of one producer run in the order they were submitted, so once the consumer has completed
+ * task n - TASK_WINDOW its node can be submitted again as task n.
+ *
+ * @param[in] arg The producer.
+ * @return NULL.
+ */
+static void *run_producer(void *arg)
+{
+    Producer *producer = (Producer *)arg;
+    for (unsigned long n = 0; n < producer->tasks; n++)
+    {
+        while (n - atomic_load_explicit(&producer->completed, memory_order_acquire) >= TASK_WINDOW)
+        {
+            sched_yield();
+        }
+        if (producer->allocate)
+        {
+            // The path submit_task() took before the nodes were embedded in their arguments
+            AllocatedTask *allocated;
+            if ((allocated = (AllocatedTask *)malloc(sizeof(AllocatedTask))) == NULL)
+            {
+                perror("task_queue_bench: malloc()");
+                abort();
+            }
+            allocated->producer = producer;
+            submit_task(producer->queue, &allocated->task, count_allocated_task, free, allocated);
+        }
+        else
+        {
+            submit_task(producer->queue, &producer->nodes[n % TASK_WINDOW], count_task, NULL, producer);
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: task_queue_bench [-m] [-p producers] [-n tasks]\n");
+    fprintf(stderr, "  -m  allocate a node for every task, as submit_task() used to\n");
+    fprintf(stderr, "  -n  tasks submitted by each producer\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int producer_count = DEFAULT_PRODUCERS;
+    unsigned long tasks = DEFAULT_TASKS;
+    bool allocate = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "mp:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            allocate = true;
+            break;
+        case 'p':
+            producer_count = atoi(optarg);
+            break;
+        case 'n':
+            tasks = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (producer_count <= 0 || tasks == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    TaskQueue queue;
+    if (init_task_queue(&queue) == -1)
+    {
+        return 1;
+    }
+    Producer *producers;
+    if ((producers = (Producer *)aligned_alloc(CACHE_LINE_SIZE, producer_count * sizeof(Producer))) == NULL)
+    {
+        perror("task_queue_bench: aligned_alloc()");
+        free_task_queue(&queue);
+        return 1;
+    }
+
+    int status = 0;
+    int started = 0;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; started < producer_count; started++)
+    {
+        Producer *producer = &producers[started];
+        atomic_init(&producer->completed, 0);
+        producer->queue = &queue;
+        producer->tasks = tasks;
+        producer->allocate = allocate;
+        if ((producer->nodes = (Task *)calloc(TASK_WINDOW, sizeof(Task))) == NULL)
+        {
+            perror("task_queue_bench: calloc()");
+            status = 1;
+            break;
+        }
+        if (pthread_create(&producer->thread, NULL, run_producer, producer) != 0)
+        {
+            perror("task_queue_bench: pthread_create()");
+            free(producer->nodes);
+            status = 1;
+            break;
+        }
+    }
+
+    // Run the tasks the way an event loop does, waiting for the eventfd whenever the queue is empty
+    unsigned long long total = (unsigned long long)started * tasks;
+    unsigned long long done = 0;
+    unsigned long long wakeups = 0;
+    struct pollfd pfd = {.fd = queue.event_fd, .events = POLLIN};
+    while (done < total)
+    {
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            perror("task_queue_bench: poll()");
+            status = 1;
+            break;
+        }
+        int count;
+        if ((count = run_tasks(&queue)) == -1)
+        {
+            status = 1;
+            break;
+        }
+        done += count;
+        wakeups++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i < started; i++)
+    {
+        if (status == 0)
+        {
+            pthread_join(producers[i].thread, NULL);
+        }
+        else
+        {
+            pthread_detach(producers[i].thread);
+        }
+    }
+    if (status == 0)
+    {
+        double seconds = elapsed_seconds(&start, &end);
+        printf("%d producers, %s nodes: %llu tasks in %.3f s, %.2f M tasks/s, %.0f ns/task, %llu wakeups, %.1f tasks/wakeup\n",
+               producer_count, allocate ? "allocated" : "embedded", done, seconds, done / seconds / 1e6, seconds * 1e9 / done,
+               wakeups, wakeups > 0 ? (double)done / wakeups : 0.0);
+        for (int i = 0; i < started; i++)
+        {
+            free(producers[i].nodes);
+        }
+        free(producers);
+        free_task_queue(&queue);
+    }
+    return status;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Compare how the server spreads a skewed load: one event loop, worker threads balanced by
+# connections or by bytes in flight, and single-loop processes sharing the port with SO_REUSEPORT.
+# A few connections echo 1 MiB probes back to back while many light connections send small
+# probes, the RTT of the light probes shows how well they are kept away from the heavy ones.
+#
+# Usage: bench/topology.sh, after make. Tunables are taken from the environment.
+set -eu
+
+cd "$(dirname "$0")/.."
+PORT=${PORT:-8090}
+LOOPS=${LOOPS:-4}                # Workers, or processes sharing the port
+HEAVY=${HEAVY:-4}                # Connections echoing large probes
+HEAVY_SIZE=${HEAVY_SIZE:-1048576}
+HEAVY_PROBES=${HEAVY_PROBES:-200}
+LIGHT=${LIGHT:-32}               # Connections echoing small probes
+LIGHT_PROBES=${LIGHT_PROBES:-200}
+LIGHT_INTERVAL=${LIGHT_INTERVAL:-5}
+
+TMP_DIR=$(mktemp -d)
+PIDS=""
+trap 'kill $PIDS 2>/dev/null || true; rm -rf "$TMP_DIR"' EXIT
+
+# write_config <file> <workers> <balance> <reuse_port>
+write_config()
+{
+    # The latency profile listens with a backlog of SOMAXCONN, the default one drops the SYNs of
+    # the light connections opened all at once
+    cat > "$1" <<CONF
+port = $PORT latency
+workers = $2
+balance = $3
+reuse_port = $4
+max_clients = 1024
+max_events = 64
+buffer_size = 65536
+log_level = error
+CONF
+}
+
+# run_scenario <name> <processes> <workers> <balance> <reuse_port>
+run_scenario()
+{
+    write_config "$TMP_DIR/server.conf" "$3" "$4" "$5"
+    PIDS=""
+    i=0
+    while [ "$i" -lt "$2" ]; do
+        ./server -c "$TMP_DIR/server.conf" > /dev/null &
+        PIDS="$PIDS $!"
+        i=$((i + 1))
+    done
+    sleep 0.5
+
+    ./client -p -c "$HEAVY" -n "$HEAVY_PROBES" -i 0 -s "$HEAVY_SIZE" 127.0.0.1 "$PORT" > "$TMP_DIR/heavy" &
+    heavy_pid=$!
+    sleep 0.2
+    ./client -p -c "$LIGHT" -n "$LIGHT_PROBES" -i "$LIGHT_INTERVAL" 127.0.0.1 "$PORT" > "$TMP_DIR/light"
+    wait "$heavy_pid" || true
+
+    kill $PIDS 2>/dev/null || true
+    wait $PIDS 2>/dev/null || true
+    PIDS=""
+    printf '%s\n  light: %s\n  heavy: %s\n' "$1" "$(tail -n 1 "$TMP_DIR/light")" "$(tail -n 1 "$TMP_DIR/heavy")"
+}
+
+run_scenario "single loop" 1 0 connections no
+run_scenario "$LOOPS workers, balance = connections" 1 "$LOOPS" connections no
+run_scenario "$LOOPS workers, balance = bytes" 1 "$LOOPS" bytes no
+run_scenario "$LOOPS processes, reuse_port = yes" "$LOOPS" 0 connections yes
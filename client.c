@@ -1,23 +1,36 @@
-#include <arpa/inet.h>
 #include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "client_pool.h"
 #include "utils.h"
 
 #define BUFFER_SIZE 256
+#define CONNECT_TIMEOUT_MS 10000
 
-int create_connected_socket(const char *ip, const char *port);
+int create_connected_socket(const char *host, const char *port_str);
+int run_probes(int argc, char **argv);
+void print_usage(const char *program);
 
 int main(int argc, char **argv)
 {
-    // Check if the IP address and port number are provided
+    // Probe mode keeps a pool of connections to every endpoint
+    if (argc > 1 && strcmp(argv[1], "-p") == 0)
+    {
+        return run_probes(argc, argv);
+    }
+
+    // Check if the host and port number are provided
     if (argc != 3)
     {
-        printf("Usage: %s <ip> <port>\n", argv[0]);
+        print_usage(argv[0]);
         exit(1);
     }
 
@@ -106,31 +119,18 @@ int main(int argc, char **argv)
 }
 
 /**
- * @brief Create a connected socket to the specified IP address and port.
+ * @brief Create a connected socket to the specified host and port.
  *
- * This function creates a socket, connects it to the specified IP address and port,
- * and returns the connected socket file descriptor.
+ * This function resolves the host, connects to its addresses happy eyeballs style, and returns
+ * the connected socket file descriptor.
  *
- * @param[in] ip The IP address to connect to.
- * @param[in] port The port number to connect to.
+ * @param[in] host The host name or IP address to connect to.
+ * @param[in] port_str The port number to connect to.
  * @return The file descriptor of the connected socket.
  * @retval -1 An error occurred during the process.
  */
-int create_connected_socket(const char *ip, const char *port_str)
+int create_connected_socket(const char *host, const char *port_str)
 {
-    // Parse the IP address
-    struct sockaddr_in server_addr4;
-    struct sockaddr_in6 server_addr6;
-    memset(&server_addr4, 0, sizeof(server_addr4));
-    memset(&server_addr6, 0, sizeof(server_addr6));
-    int is_ipv4 = inet_pton(PF_INET, ip, &server_addr4.sin_addr);
-    int is_ipv6 = inet_pton(PF_INET6, ip, &server_addr6.sin6_addr);
-    if (is_ipv4 <= 0 && is_ipv6 <= 0)
-    {
-        printf("Invalid IP address: %s\n", ip);
-        return -1;
-    }
-
     // Parse the port number
     int port;
     if ((port = parse_port(port_str)) == -1)
@@ -139,58 +139,131 @@ int create_connected_socket(const char *ip, const char *port_str)
         return -1;
     }
 
-    // Create a socket and connect to the server
     int socket_fd;
-    if (is_ipv4 == 1)
+    int resolve_error;
+    if ((socket_fd = connect_to_host(host, port_str, CONNECT_TIMEOUT_MS, &resolve_error)) == -1)
     {
-        if ((socket_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+        if (resolve_error != 0)
         {
-            perror("client: socket()");
-            return -1;
+            printf("client: getaddrinfo(%s, %s): %s\n", host, port_str, gai_strerror(resolve_error));
         }
-
-        server_addr4.sin_family = PF_INET;
-        server_addr4.sin_port = htons(port);
-
-        while (connect(socket_fd, (struct sockaddr *)&server_addr4, sizeof(server_addr4)) == -1)
+        else
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            perror("client: connect() using IPv4");
-            close_with_retry(socket_fd);
-            return -1;
+            perror("client: connect()");
         }
+        return -1;
     }
-    else if (is_ipv6 == 1)
+
+    printf("Connected to %s, %d\n", host, port);
+    return socket_fd;
+}
+
+/**
+ * @brief Probe the given endpoints over a pool of warm connections until stopped.
+ *
+ * @param[in] argc The number of arguments.
+ * @param[in] argv The arguments, options followed by host and port pairs.
+ * @return The exit code of the client.
+ */
+int run_probes(int argc, char **argv)
+{
+    int connections_per_endpoint = 1;
+    int interval_ms = 1000;
+    int timeout_ms = 1000;
+    long long probe_count = 0;
+    long long probe_size = 0;
+    bool fastopen = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "pc:i:t:n:s:f")) != -1)
     {
-        if ((socket_fd = socket(PF_INET6, SOCK_STREAM, 0)) == -1)
+        switch (opt)
         {
-            perror("client: socket() using IPv6");
-            return -1;
+        case 'p':
+            break;
+        case 'c':
+            connections_per_endpoint = atoi(optarg);
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'n':
+            probe_count = atoll(optarg);
+            break;
+        case 's':
+            probe_size = atoll(optarg);
+            break;
+        case 'f':
+            fastopen = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
         }
+    }
+    int endpoint_count = (argc - optind) / 2;
+    if (endpoint_count == 0 || (argc - optind) % 2 != 0 || connections_per_endpoint <= 0 || interval_ms < 0 || timeout_ms <= 0 || probe_count < 0 ||
+        probe_size < 0 || probe_size > POOL_MAX_PROBE_SIZE)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (probe_size > 0 && probe_size < POOL_MIN_PROBE_SIZE)
+    {
+        // A smaller probe could not hold its header and would silently be sent larger
+        printf("client: the probe size must be at least %d bytes\n", POOL_MIN_PROBE_SIZE);
+        return 1;
+    }
 
-        server_addr6.sin6_family = PF_INET6;
-        server_addr6.sin6_port = htons(port);
+    // Stop on SIGINT and print what was measured so far
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    int signal_fd;
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 || (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+        perror("client: signalfd()");
+        return 1;
+    }
 
-        while (connect(socket_fd, (struct sockaddr *)&server_addr6, sizeof(server_addr6)) == -1)
+    srand((unsigned int)(monotonic_ms() ^ getpid()));
+    ClientPool pool;
+    int status = 1;
+    if (init_client_pool(&pool, endpoint_count, connections_per_endpoint) == -1)
+    {
+        close_with_retry(signal_fd);
+        return 1;
+    }
+    pool.interval_ms = interval_ms;
+    pool.timeout_ms = timeout_ms;
+    pool.probe_count = (unsigned long long)probe_count;
+    pool.probe_size = (size_t)probe_size;
+    pool.fastopen = fastopen;
+    for (int i = optind; i + 1 < argc; i += 2)
+    {
+        if (add_pool_endpoint(&pool, argv[i], argv[i + 1]) == -1)
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            perror("client: connect() using IPv6");
-            close_with_retry(socket_fd);
-            return -1;
+            goto cleanup;
         }
     }
-    else
+
+    if (run_client_pool(&pool, signal_fd) == 0)
     {
-        puts("Reached the unreachable");
-        return -1;
+        status = 0;
     }
+    print_pool_stats(&pool);
 
-    printf("Connected to %s, %d\n", ip, port);
-    return socket_fd;
+cleanup:
+    free_client_pool(&pool);
+    close_with_retry(signal_fd);
+    return status;
+}
+
+void print_usage(const char *program)
+{
+    printf("Usage: %s <host> <port>\n", program);
+    printf("       %s -p [-c connections] [-i interval_ms] [-t timeout_ms] [-n probes] [-s probe_size] [-f] <host> <port> [<host> <port>...]\n", program);
+    printf("       probe_size is %d to %d bytes, 0 for a short \"probe N\" line\n", POOL_MIN_PROBE_SIZE, POOL_MAX_PROBE_SIZE);
 }
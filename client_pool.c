@@ -0,0 +1,912 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client_pool.h"
+#include "utils.h"
+
+#define POOL_MAX_EVENTS 64
+
+static long long monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Resolve a host name and port to a list of addresses.
+ *
+ * The addresses keep the order getaddrinfo() sorted them in within each family, but the families
+ * alternate, starting with the family of the preferred address.
+ *
+ * @param[in] host The host name or numeric address.
+ * @param[in] port The port number or service name.
+ * @param[out] addresses The resolved addresses.
+ * @return The status of the resolution.
+ * @retval 0 The host was resolved to at least one address.
+ * @retval other The EAI_* error of getaddrinfo(), to be described with gai_strerror().
+ */
+int resolve_addresses(const char *host, const char *port, AddressList *addresses)
+{
+    struct addrinfo hints, *res, *res0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    int getaddrinfo_result;
+    if ((getaddrinfo_result = getaddrinfo(host, port, &hints, &res0)) != 0)
+    {
+        return getaddrinfo_result;
+    }
+
+    // Split the addresses into the preferred family and the other one, then take them in turns
+    const struct addrinfo *families[2][POOL_MAX_ADDRESSES];
+    int family_counts[2] = {0, 0};
+    for (res = res0; res != NULL; res = res->ai_next)
+    {
+        int family = res->ai_family == res0->ai_family ? 0 : 1;
+        if (family_counts[family] < POOL_MAX_ADDRESSES)
+        {
+            families[family][family_counts[family]++] = res;
+        }
+    }
+    addresses->count = 0;
+    for (int i = 0; i < family_counts[0] || i < family_counts[1]; i++)
+    {
+        for (int family = 0; family < 2; family++)
+        {
+            if (i < family_counts[family] && addresses->count < POOL_MAX_ADDRESSES)
+            {
+                memcpy(&addresses->addrs[addresses->count], families[family][i]->ai_addr, families[family][i]->ai_addrlen);
+                addresses->addr_lens[addresses->count] = families[family][i]->ai_addrlen;
+                addresses->count++;
+            }
+        }
+    }
+
+    freeaddrinfo(res0);
+    return addresses->count > 0 ? 0 : EAI_NONAME;
+}
+
+/**
+ * @brief Prepare a connection attempt. No connection is made until it is advanced.
+ *
+ * @param[out] attempt The connection attempt.
+ * @param[in] addresses The addresses to try, they must outlive the attempt.
+ * @param[in] epoll_fd The epoll instance the sockets of the attempt are registered with.
+ * @param[in] tag The epoll data of the attempt, the index of the address is added to it.
+ * @param[in] fastopen Connect with TCP Fast Open. The connect completes locally and the SYN is
+ * sent with the first data, so the first address always wins and a failure only shows on the
+ * connected socket.
+ */
+void start_connect_attempt(ConnectAttempt *attempt, const AddressList *addresses, int epoll_fd, uint64_t tag, bool fastopen)
+{
+    attempt->addresses = addresses;
+    attempt->epoll_fd = epoll_fd;
+    attempt->tag = tag;
+    for (int i = 0; i < POOL_MAX_ADDRESSES; i++)
+    {
+        attempt->fds[i] = -1;
+    }
+    attempt->next = 0;
+    attempt->in_flight = 0;
+    attempt->next_attempt_ms = 0;
+    attempt->error = 0;
+    attempt->fastopen = fastopen;
+}
+
+/**
+ * @brief Start a non-blocking connect to one address of an attempt.
+ *
+ * @param[in] attempt The connection attempt.
+ * @param[in] slot The index of the address.
+ * @param[out] socket_fd The connected socket, if it connected right away.
+ * @return The status of the connect.
+ * @retval 1 The socket connected right away.
+ * @retval 0 The connect is in progress.
+ * @retval -1 The connect failed.
+ */
+static int start_connect(ConnectAttempt *attempt, int slot, int *socket_fd)
+{
+    const struct sockaddr_storage *addr = &attempt->addresses->addrs[slot];
+    int fd;
+    if ((fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    {
+        attempt->error = errno;
+        return -1;
+    }
+
+    // Without a cached cookie the kernel falls back to a regular handshake on the first send
+    int yes = 1;
+    if (attempt->fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(int)) == -1)
+    {
+        attempt->error = errno;
+        close_with_retry(fd);
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr *)addr, attempt->addresses->addr_lens[slot]) == 0)
+    {
+        *socket_fd = fd;
+        return 1;
+    }
+    // An interrupted non-blocking connect carries on in the background
+    if (errno != EINPROGRESS && errno != EINTR)
+    {
+        attempt->error = errno;
+        close_with_retry(fd);
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.u64 = attempt->tag | (uint64_t)slot;
+    if (epoll_ctl(attempt->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        attempt->error = errno;
+        close_with_retry(fd);
+        return -1;
+    }
+    attempt->fds[slot] = fd;
+    attempt->in_flight++;
+    return 0;
+}
+
+/**
+ * @brief Move a connection attempt forward.
+ *
+ * This function is called when the socket of an address became writable, and whenever the head
+ * start of the newest connect may have run out. A failed connect starts the next address right
+ * away. Once a connect completes, the other ones are abandoned and the socket is handed over,
+ * still non-blocking and no longer registered with epoll.
+ *
+ * @param[in] attempt The connection attempt.
+ * @param[in] ready_slot The index of the address whose socket became writable, -1 for none.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @param[out] socket_fd The connected socket.
+ * @return The status of the attempt.
+ * @retval 1 The attempt connected.
+ * @retval 0 The attempt is still in progress.
+ * @retval -1 Every address failed, the error of the last one is in attempt->error.
+ */
+int advance_connect_attempt(ConnectAttempt *attempt, int ready_slot, long long now_ms, int *socket_fd)
+{
+    if (ready_slot >= 0 && ready_slot < POOL_MAX_ADDRESSES && attempt->fds[ready_slot] != -1)
+    {
+        int fd = attempt->fds[ready_slot];
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+        {
+            error = errno;
+        }
+
+        attempt->fds[ready_slot] = -1;
+        attempt->in_flight--;
+        if (error == 0)
+        {
+            epoll_ctl(attempt->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            cancel_connect_attempt(attempt);
+            *socket_fd = fd;
+            return 1;
+        }
+        attempt->error = error;
+        close_with_retry(fd);
+        attempt->next_attempt_ms = now_ms;
+    }
+
+    while (attempt->next < attempt->addresses->count && (attempt->in_flight == 0 || now_ms >= attempt->next_attempt_ms))
+    {
+        int result = start_connect(attempt, attempt->next++, socket_fd);
+        if (result == 1)
+        {
+            cancel_connect_attempt(attempt);
+            return 1;
+        }
+        if (result == 0)
+        {
+            attempt->next_attempt_ms = now_ms + POOL_ATTEMPT_DELAY_MS;
+        }
+    }
+
+    return attempt->in_flight > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Abandon the connects of an attempt that are still in flight.
+ *
+ * @param[in] attempt The connection attempt.
+ */
+void cancel_connect_attempt(ConnectAttempt *attempt)
+{
+    for (int i = 0; i < POOL_MAX_ADDRESSES; i++)
+    {
+        if (attempt->fds[i] != -1)
+        {
+            // Closing the socket also removes it from the epoll instance
+            close_with_retry(attempt->fds[i]);
+            attempt->fds[i] = -1;
+        }
+    }
+    attempt->in_flight = 0;
+    attempt->next = attempt->addresses->count;
+}
+
+/**
+ * @brief Connect to a host, trying its addresses happy eyeballs style.
+ *
+ * @param[in] host The host name or numeric address.
+ * @param[in] port The port number or service name.
+ * @param[in] timeout_ms The time allowed for the whole attempt.
+ * @param[out] resolve_error The EAI_* error if the host could not be resolved, 0 otherwise.
+ * @return The file descriptor of the connected socket, in blocking mode.
+ * @retval -1 An error occurred during the process, errno tells the last failure unless
+ *            resolve_error is set.
+ */
+int connect_to_host(const char *host, const char *port, int timeout_ms, int *resolve_error)
+{
+    AddressList addresses;
+    if ((*resolve_error = resolve_addresses(host, port, &addresses)) != 0)
+    {
+        return -1;
+    }
+
+    int epoll_fd;
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        return -1;
+    }
+
+    ConnectAttempt attempt;
+    start_connect_attempt(&attempt, &addresses, epoll_fd, 0, false);
+    long long deadline_ms = monotonic_ms() + timeout_ms;
+    int socket_fd = -1;
+    int result = advance_connect_attempt(&attempt, -1, monotonic_ms(), &socket_fd);
+    while (result == 0)
+    {
+        long long now_ms = monotonic_ms();
+        if (now_ms >= deadline_ms)
+        {
+            cancel_connect_attempt(&attempt);
+            attempt.error = ETIMEDOUT;
+            result = -1;
+            break;
+        }
+        long long wait_ms = deadline_ms - now_ms;
+        if (attempt.next < addresses.count && attempt.next_attempt_ms - now_ms < wait_ms)
+        {
+            wait_ms = attempt.next_attempt_ms > now_ms ? attempt.next_attempt_ms - now_ms : 0;
+        }
+
+        struct epoll_event events[POOL_MAX_ADDRESSES];
+        int nfds = epoll_wait(epoll_fd, events, POOL_MAX_ADDRESSES, (int)wait_ms);
+        if (nfds == -1 && errno != EINTR)
+        {
+            attempt.error = errno;
+            cancel_connect_attempt(&attempt);
+            result = -1;
+            break;
+        }
+        result = advance_connect_attempt(&attempt, -1, monotonic_ms(), &socket_fd);
+        for (int i = 0; i < nfds && result == 0; i++)
+        {
+            result = advance_connect_attempt(&attempt, (int)(events[i].data.u64 & 0xff), monotonic_ms(), &socket_fd);
+        }
+    }
+    close_with_retry(epoll_fd);
+
+    if (result == -1)
+    {
+        errno = attempt.error;
+        return -1;
+    }
+    int flags = fcntl(socket_fd, F_GETFL);
+    if (flags == -1 || fcntl(socket_fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        int error = errno;
+        close_with_retry(socket_fd);
+        errno = error;
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * @brief Initialize a pool of probing connections.
+ *
+ * @param[out] pool The client pool.
+ * @param[in] endpoint_count The number of endpoints that are going to be added.
+ * @param[in] connections_per_endpoint The number of connections kept open to each endpoint.
+ * @return The status of the process.
+ * @retval 0 The pool was successfully initialized.
+ * @retval -1 An error occurred during the process.
+ */
+int init_client_pool(ClientPool *pool, int endpoint_count, int connections_per_endpoint)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->connections_per_endpoint = connections_per_endpoint;
+    pool->interval_ms = 1000;
+    pool->timeout_ms = 1000;
+
+    if ((pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        perror("client: epoll_create1()");
+        return -1;
+    }
+    pool->endpoints = (PoolEndpoint *)calloc(endpoint_count, sizeof(PoolEndpoint));
+    pool->connections = (PoolConnection *)calloc((size_t)endpoint_count * connections_per_endpoint, sizeof(PoolConnection));
+    if (pool->endpoints == NULL || pool->connections == NULL)
+    {
+        perror("client: calloc()");
+        free_client_pool(pool);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Add an endpoint to the pool along with its connections.
+ *
+ * The probe buffers of the connections are sized here, so probe_size must be set beforehand.
+ * An endpoint whose host cannot be resolved is still added, its connections fail and resolve
+ * it again as they reconnect.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] host The host name or numeric address.
+ * @param[in] port The port number or service name.
+ * @return The status of the process.
+ * @retval 0 The endpoint was added.
+ * @retval -1 The probe buffers could not be allocated.
+ */
+int add_pool_endpoint(ClientPool *pool, const char *host, const char *port)
+{
+    PoolEndpoint *endpoint = &pool->endpoints[pool->endpoint_count];
+    int resolve_error;
+    if ((resolve_error = resolve_addresses(host, port, &endpoint->addresses)) != 0)
+    {
+        printf("client: getaddrinfo(%s, %s): %s\n", host, port, gai_strerror(resolve_error));
+        endpoint->addresses.count = 0;
+        endpoint->stale = true;
+        endpoint->resolve_failures++;
+    }
+    endpoint->host = host;
+    endpoint->port = port;
+    endpoint->rtt_min_us = LLONG_MAX;
+
+    size_t probe_capacity = pool->probe_size > POOL_PROBE_SIZE ? pool->probe_size : POOL_PROBE_SIZE;
+    for (int i = 0; i < pool->connections_per_endpoint; i++)
+    {
+        PoolConnection *connection = &pool->connections[pool->connection_count++];
+        connection->endpoint = pool->endpoint_count;
+        connection->state = POOL_STATE_WAITING;
+        connection->socket_fd = -1;
+        connection->backoff_ms = POOL_MIN_BACKOFF_MS;
+        connection->deadline_ms = 0;
+        if ((connection->probe = (char *)malloc(probe_capacity)) == NULL)
+        {
+            perror("client: malloc()");
+            return -1;
+        }
+        // Large probes are padded, only their "probe N" header changes from one probe to the next
+        memset(connection->probe, 'x', probe_capacity);
+    }
+    pool->endpoint_count++;
+    return 0;
+}
+
+/**
+ * @brief Drop a connection after a failure and schedule a reconnect.
+ *
+ * The delay doubles with every failure in a row, with jitter so that connections to a server
+ * that went down do not all come back at once.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] connection The connection.
+ * @param[in] reason What went wrong.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ */
+static void fail_connection(ClientPool *pool, PoolConnection *connection, const char *reason, long long now_ms)
+{
+    PoolEndpoint *endpoint = &pool->endpoints[connection->endpoint];
+    if (connection->state == POOL_STATE_CONNECTING)
+    {
+        cancel_connect_attempt(&connection->attempt);
+    }
+    if (connection->socket_fd != -1)
+    {
+        close_with_retry(connection->socket_fd);
+        connection->socket_fd = -1;
+    }
+
+    // A probe that could not be made counts as a failed one
+    endpoint->probes_failed++;
+    connection->probes++;
+    if (pool->probe_count > 0 && connection->probes >= pool->probe_count)
+    {
+        connection->state = POOL_STATE_DONE;
+        pool->done_count++;
+        printf("%s %s: %s\n", endpoint->host, endpoint->port, reason);
+        return;
+    }
+
+    // The host may have moved, resolve it again before reconnecting
+    endpoint->stale = true;
+
+    unsigned int delay_ms = connection->backoff_ms / 2 + (unsigned int)rand() % (connection->backoff_ms / 2 + 1);
+    printf("%s %s: %s, reconnecting in %u ms\n", endpoint->host, endpoint->port, reason, delay_ms);
+    connection->state = POOL_STATE_WAITING;
+    connection->deadline_ms = now_ms + delay_ms;
+    connection->backoff_ms = connection->backoff_ms * 2 > POOL_MAX_BACKOFF_MS ? POOL_MAX_BACKOFF_MS : connection->backoff_ms * 2;
+}
+
+/**
+ * @brief Change the epoll events of a connected socket.
+ *
+ * @return The status of the process.
+ * @retval 0 The events were changed.
+ * @retval -1 An error occurred during the process.
+ */
+static int set_connection_events(ClientPool *pool, PoolConnection *connection, uint32_t events, int op)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = POOL_TAG(connection - pool->connections, POOL_SLOT_CONNECTED);
+    return epoll_ctl(pool->epoll_fd, op, connection->socket_fd, &event);
+}
+
+/**
+ * @brief Send as much of the current probe as the socket takes.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] connection The connection.
+ * @return The status of the process.
+ * @retval 0 The probe was sent or is waiting for EPOLLOUT.
+ * @retval -1 An error occurred during the process.
+ */
+static int send_probe(ClientPool *pool, PoolConnection *connection)
+{
+    while (connection->probe_sent < connection->probe_len)
+    {
+        ssize_t sent_bytes = send(connection->socket_fd, connection->probe + connection->probe_sent, connection->probe_len - connection->probe_sent, MSG_NOSIGNAL);
+        if (sent_bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return set_connection_events(pool, connection, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+            }
+            return -1;
+        }
+        connection->probe_sent += sent_bytes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Start the next probe on an idle connection.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] connection The connection.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ */
+static void start_probe(ClientPool *pool, PoolConnection *connection, long long now_ms)
+{
+    int header_len = snprintf(connection->probe, POOL_PROBE_SIZE, "probe %u\n", connection->sequence++);
+    connection->probe_len = header_len;
+    if (pool->probe_size > (size_t)header_len)
+    {
+        // Turn the header back into padding, the line ends with the probe
+        connection->probe[header_len - 1] = ' ';
+        connection->probe[header_len] = 'x';
+        connection->probe[pool->probe_size - 1] = '\n';
+        connection->probe_len = pool->probe_size;
+    }
+    connection->probe_sent = 0;
+    connection->probe_received = 0;
+    connection->probe_start_us = monotonic_us();
+    connection->state = POOL_STATE_PROBING;
+    connection->deadline_ms = now_ms + pool->timeout_ms;
+    if (send_probe(pool, connection) == -1)
+    {
+        fail_connection(pool, connection, strerror(errno), now_ms);
+    }
+}
+
+/**
+ * @brief Read the echo of the current probe.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] connection The connection.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ */
+static void receive_probe(ClientPool *pool, PoolConnection *connection, long long now_ms)
+{
+    PoolEndpoint *endpoint = &pool->endpoints[connection->endpoint];
+    char buf[POOL_RECV_SIZE];
+    while (1)
+    {
+        ssize_t received_bytes = recv(connection->socket_fd, buf, sizeof(buf), 0);
+        if (received_bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            fail_connection(pool, connection, strerror(errno), now_ms);
+            return;
+        }
+        if (received_bytes == 0)
+        {
+            fail_connection(pool, connection, "connection closed by server", now_ms);
+            return;
+        }
+        // Anything but the echo of the probe in flight means the server is not healthy
+        if (connection->state != POOL_STATE_PROBING || connection->probe_received + received_bytes > connection->probe_len ||
+            memcmp(buf, connection->probe + connection->probe_received, received_bytes) != 0)
+        {
+            fail_connection(pool, connection, "unexpected reply", now_ms);
+            return;
+        }
+        connection->probe_received += received_bytes;
+        if (connection->probe_received == connection->probe_len)
+        {
+            break;
+        }
+    }
+
+    long long end_us = monotonic_us();
+    long long rtt_us = end_us - connection->probe_start_us;
+    if (connection->connect_start_us != 0)
+    {
+        // Includes the handshake, which TCP Fast Open folds into the first probe
+        endpoint->first_echoes++;
+        endpoint->first_echo_total_us += end_us - connection->connect_start_us;
+        connection->connect_start_us = 0;
+    }
+    endpoint->probes_ok++;
+    endpoint->bytes_ok += connection->probe_len;
+    endpoint->rtt_total_us += rtt_us;
+    endpoint->rtt_min_us = rtt_us < endpoint->rtt_min_us ? rtt_us : endpoint->rtt_min_us;
+    endpoint->rtt_max_us = rtt_us > endpoint->rtt_max_us ? rtt_us : endpoint->rtt_max_us;
+    connection->backoff_ms = POOL_MIN_BACKOFF_MS;
+    connection->probes++;
+    if (pool->probe_count > 0 && connection->probes >= pool->probe_count)
+    {
+        close_with_retry(connection->socket_fd);
+        connection->socket_fd = -1;
+        connection->state = POOL_STATE_DONE;
+        pool->done_count++;
+        return;
+    }
+    connection->state = POOL_STATE_IDLE;
+    connection->deadline_ms = connection->probe_start_us / 1000 + pool->interval_ms;
+}
+
+/**
+ * @brief Handle a connection attempt that completed or failed.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] connection The connection.
+ * @param[in] result The result of advance_connect_attempt().
+ * @param[in] socket_fd The connected socket if the attempt succeeded.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ */
+static void finish_connect(ClientPool *pool, PoolConnection *connection, int result, int socket_fd, long long now_ms)
+{
+    PoolEndpoint *endpoint = &pool->endpoints[connection->endpoint];
+    if (result == -1)
+    {
+        fail_connection(pool, connection, strerror(connection->attempt.error), now_ms);
+        return;
+    }
+    if (result == 0)
+    {
+        return;
+    }
+
+    connection->socket_fd = socket_fd;
+
+    // Probes are sent in one go, Nagle's algorithm would only add the delay of this side to the RTT
+    int yes = 1;
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1 ||
+        set_connection_events(pool, connection, EPOLLIN, EPOLL_CTL_ADD) == -1)
+    {
+        connection->state = POOL_STATE_IDLE;
+        fail_connection(pool, connection, strerror(errno), now_ms);
+        return;
+    }
+    endpoint->connects++;
+    log_printf(LOG_LEVEL_DEBUG, "%s %s: connected (fd: %d)\n", endpoint->host, endpoint->port, socket_fd);
+    start_probe(pool, connection, now_ms);
+}
+
+/**
+ * @brief Resolve the host of an endpoint again.
+ *
+ * The previous addresses are kept if the resolution fails. Attempts in flight carry on with the
+ * new addresses. getaddrinfo() blocks the whole pool, which is why this only happens before a
+ * reconnect that follows a failure.
+ *
+ * @param[in] endpoint The endpoint.
+ * @return The status of the resolution.
+ * @retval 0 The host was resolved to at least one address.
+ * @retval other The EAI_* error of getaddrinfo().
+ */
+static int resolve_endpoint(PoolEndpoint *endpoint)
+{
+    AddressList addresses;
+    int resolve_error;
+    if ((resolve_error = resolve_addresses(endpoint->host, endpoint->port, &addresses)) != 0)
+    {
+        endpoint->resolve_failures++;
+        return resolve_error;
+    }
+    endpoint->addresses = addresses;
+    endpoint->stale = false;
+    return 0;
+}
+
+/**
+ * @brief Handle the timer of a connection once its deadline has passed.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] connection The connection.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ */
+static void handle_deadline(ClientPool *pool, PoolConnection *connection, long long now_ms)
+{
+    PoolEndpoint *endpoint = &pool->endpoints[connection->endpoint];
+    int socket_fd = -1;
+    int result;
+    switch (connection->state)
+    {
+    case POOL_STATE_WAITING:
+        if (endpoint->stale && (result = resolve_endpoint(endpoint)) != 0)
+        {
+            fail_connection(pool, connection, gai_strerror(result), now_ms);
+            break;
+        }
+        connection->connect_start_us = monotonic_us();
+        start_connect_attempt(&connection->attempt, &endpoint->addresses, pool->epoll_fd, POOL_TAG(connection - pool->connections, 0), pool->fastopen);
+        connection->state = POOL_STATE_CONNECTING;
+        connection->deadline_ms = now_ms + pool->timeout_ms;
+        result = advance_connect_attempt(&connection->attempt, -1, now_ms, &socket_fd);
+        finish_connect(pool, connection, result, socket_fd, now_ms);
+        break;
+    case POOL_STATE_CONNECTING:
+        fail_connection(pool, connection, "connect timed out", now_ms);
+        break;
+    case POOL_STATE_IDLE:
+        start_probe(pool, connection, now_ms);
+        break;
+    case POOL_STATE_PROBING:
+        fail_connection(pool, connection, "probe timed out", now_ms);
+        break;
+    }
+}
+
+/**
+ * @brief Get the time until the next deadline of the pool.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return The epoll_wait() timeout in milliseconds.
+ */
+static int next_timeout(const ClientPool *pool, long long now_ms)
+{
+    long long next_ms = LLONG_MAX;
+    for (int i = 0; i < pool->connection_count; i++)
+    {
+        const PoolConnection *connection = &pool->connections[i];
+        if (connection->state == POOL_STATE_DONE)
+        {
+            continue;
+        }
+        if (connection->deadline_ms < next_ms)
+        {
+            next_ms = connection->deadline_ms;
+        }
+        // The next address of an attempt is due before the attempt times out
+        const ConnectAttempt *attempt = &connection->attempt;
+        if (connection->state == POOL_STATE_CONNECTING && attempt->next < attempt->addresses->count && attempt->next_attempt_ms < next_ms)
+        {
+            next_ms = attempt->next_attempt_ms;
+        }
+    }
+    if (next_ms == LLONG_MAX)
+    {
+        return -1;
+    }
+    return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+}
+
+/**
+ * @brief Run the probes of the pool.
+ *
+ * Every connection is opened, probed every interval_ms, and reopened with backoff whenever it
+ * fails, all concurrently on a single epoll instance.
+ *
+ * @param[in] pool The client pool.
+ * @param[in] signal_fd A signalfd that stops the pool when readable, -1 for none.
+ * @return The status of the run.
+ * @retval 0 Every probe was issued, or the pool was stopped.
+ * @retval -1 An error occurred during the process.
+ */
+int run_client_pool(ClientPool *pool, int signal_fd)
+{
+    if (signal_fd != -1)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = POOL_TAG_SIGNAL;
+        if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1)
+        {
+            perror("client: epoll_ctl()");
+            return -1;
+        }
+    }
+
+    while (pool->done_count < pool->connection_count)
+    {
+        struct epoll_event events[POOL_MAX_EVENTS];
+        int nfds = epoll_wait(pool->epoll_fd, events, POOL_MAX_EVENTS, next_timeout(pool, monotonic_ms()));
+        if (nfds == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("client: epoll_wait()");
+            return -1;
+        }
+
+        long long now_ms = monotonic_ms();
+        for (int i = 0; i < nfds; i++)
+        {
+            if (events[i].data.u64 == POOL_TAG_SIGNAL)
+            {
+                struct signalfd_siginfo siginfo;
+                if (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo))
+                {
+                    return 0;
+                }
+                continue;
+            }
+
+            PoolConnection *connection = &pool->connections[events[i].data.u64 >> 8];
+            int slot = (int)(events[i].data.u64 & 0xff);
+            if (slot != POOL_SLOT_CONNECTED)
+            {
+                // Events of attempts that were abandoned earlier in the batch are stale
+                if (connection->state == POOL_STATE_CONNECTING)
+                {
+                    int socket_fd = -1;
+                    int result = advance_connect_attempt(&connection->attempt, slot, now_ms, &socket_fd);
+                    finish_connect(pool, connection, result, socket_fd, now_ms);
+                }
+                continue;
+            }
+            if (connection->state != POOL_STATE_IDLE && connection->state != POOL_STATE_PROBING)
+            {
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && connection->state == POOL_STATE_PROBING)
+            {
+                if (send_probe(pool, connection) == -1)
+                {
+                    fail_connection(pool, connection, strerror(errno), now_ms);
+                    continue;
+                }
+                if (connection->probe_sent == connection->probe_len && set_connection_events(pool, connection, EPOLLIN, EPOLL_CTL_MOD) == -1)
+                {
+                    fail_connection(pool, connection, strerror(errno), now_ms);
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                receive_probe(pool, connection, now_ms);
+            }
+        }
+
+        // Connections whose deadline passed, including attempts due to try their next address
+        now_ms = monotonic_ms();
+        for (int i = 0; i < pool->connection_count; i++)
+        {
+            PoolConnection *connection = &pool->connections[i];
+            if (connection->state == POOL_STATE_DONE)
+            {
+                continue;
+            }
+            if (connection->deadline_ms <= now_ms)
+            {
+                handle_deadline(pool, connection, now_ms);
+            }
+            else if (connection->state == POOL_STATE_CONNECTING && now_ms >= connection->attempt.next_attempt_ms)
+            {
+                int socket_fd = -1;
+                int result = advance_connect_attempt(&connection->attempt, -1, now_ms, &socket_fd);
+                finish_connect(pool, connection, result, socket_fd, now_ms);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Print the probe statistics of every endpoint.
+ *
+ * @param[in] pool The client pool.
+ */
+void print_pool_stats(const ClientPool *pool)
+{
+    for (int i = 0; i < pool->endpoint_count; i++)
+    {
+        const PoolEndpoint *endpoint = &pool->endpoints[i];
+        printf("%s %s: probes ok: %llu, failed: %llu, connects: %llu", endpoint->host, endpoint->port, endpoint->probes_ok, endpoint->probes_failed, endpoint->connects);
+        if (endpoint->resolve_failures > 0)
+        {
+            printf(", resolve failures: %llu", endpoint->resolve_failures);
+        }
+        if (endpoint->probes_ok > 0)
+        {
+            printf(", rtt min/avg/max: %lld/%lld/%lld us", endpoint->rtt_min_us, endpoint->rtt_total_us / (long long)endpoint->probes_ok, endpoint->rtt_max_us);
+            if (pool->probe_size > 0 && endpoint->rtt_total_us > 0)
+            {
+                // Bytes per microsecond of probe time, the rate of a single connection
+                printf(", echo rate: %.1f MB/s", (double)endpoint->bytes_ok / (double)endpoint->rtt_total_us);
+            }
+            if (endpoint->first_echoes > 0)
+            {
+                printf(", first echo avg: %lld us", endpoint->first_echo_total_us / (long long)endpoint->first_echoes);
+            }
+        }
+        printf("\n");
+    }
+}
+
+void free_client_pool(ClientPool *pool)
+{
+    for (int i = 0; i < pool->connection_count; i++)
+    {
+        PoolConnection *connection = &pool->connections[i];
+        if (connection->state == POOL_STATE_CONNECTING)
+        {
+            cancel_connect_attempt(&connection->attempt);
+        }
+        if (connection->socket_fd != -1)
+        {
+            close_with_retry(connection->socket_fd);
+        }
+        free(connection->probe);
+    }
+    if (pool->epoll_fd != -1)
+    {
+        close_with_retry(pool->epoll_fd);
+    }
+    free(pool->endpoints);
+    free(pool->connections);
+    memset(pool, 0, sizeof(*pool));
+    pool->epoll_fd = -1;
+}
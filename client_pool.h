@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef CLIENT_POOL_H
+#define CLIENT_POOL_H
+
+#define POOL_MAX_ADDRESSES 16
+#define POOL_ATTEMPT_DELAY_MS 250 // Head start of a connection attempt before the next address is tried, as in RFC 8305
+#define POOL_MIN_BACKOFF_MS 100
+#define POOL_MAX_BACKOFF_MS 30000
+#define POOL_PROBE_SIZE 32 // Size of the probe buffer unless larger probes are sent
+#define POOL_MIN_PROBE_SIZE 17 // Longest "probe N" header, every probe starts with one
+#define POOL_MAX_PROBE_SIZE (64 * 1024 * 1024)
+#define POOL_RECV_SIZE 65536
+
+#define POOL_TAG(index, slot) (((uint64_t)(index) << 8) | (slot)) // epoll data of pool sockets
+#define POOL_SLOT_CONNECTED 0xff // Slot of an established connection, lower slots are connection attempts
+#define POOL_TAG_SIGNAL UINT64_MAX
+
+/**
+ * The addresses of a host, interleaved by address family so that a broken
+ * IPv6 or IPv4 path only delays the first attempt.
+ */
+typedef struct
+{
+    struct sockaddr_storage addrs[POOL_MAX_ADDRESSES];
+    socklen_t addr_lens[POOL_MAX_ADDRESSES];
+    int count;
+} AddressList;
+
+/**
+ * A happy eyeballs connection attempt. Each address gets a non-blocking
+ * connect, started after the previous one failed or had a head start of
+ * POOL_ATTEMPT_DELAY_MS, and the first one to complete wins.
+ */
+typedef struct
+{
+    const AddressList *addresses;
+    int epoll_fd;
+    uint64_t tag;
+    int fds[POOL_MAX_ADDRESSES]; // Sockets of the attempts in flight, -1 if none, indexed like addresses
+    int next;                    // Index of the next address to try
+    int in_flight;
+    long long next_attempt_ms;
+    int error;     // errno of the last failed attempt
+    bool fastopen; // Connect with TCP_FASTOPEN_CONNECT, the SYN waits for the first send
+} ConnectAttempt;
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    AddressList addresses;
+    bool stale; // Resolve the host again before the next connect, set after a failure
+    unsigned long long probes_ok;
+    unsigned long long resolve_failures;
+    unsigned long long probes_failed;
+    unsigned long long connects;
+    unsigned long long bytes_ok; // Bytes echoed by the successful probes
+    unsigned long long first_echoes;
+    long long first_echo_total_us; // Time from the start of a connect to the echo of its first probe
+    long long rtt_min_us;
+    long long rtt_max_us;
+    long long rtt_total_us;
+} PoolEndpoint;
+
+#define POOL_STATE_WAITING 0    // Waiting for the backoff to expire before reconnecting
+#define POOL_STATE_CONNECTING 1 // A connection attempt is in flight
+#define POOL_STATE_IDLE 2       // Connected, waiting for the next probe
+#define POOL_STATE_PROBING 3    // A probe was sent and its echo is expected
+#define POOL_STATE_DONE 4       // Every probe has been issued
+
+typedef struct
+{
+    int endpoint;
+    int state;
+    int socket_fd;
+    ConnectAttempt attempt;
+    long long deadline_ms; // When the current state times out or the next probe is due
+    unsigned int backoff_ms;
+    unsigned int sequence;
+    unsigned long long probes;
+    long long connect_start_us; // 0 once the first probe of the connection was echoed
+    long long probe_start_us;
+    char *probe; // POOL_PROBE_SIZE bytes, or probe_size if larger
+    size_t probe_len;
+    size_t probe_sent;
+    size_t probe_received;
+} PoolConnection;
+
+typedef struct
+{
+    int epoll_fd;
+    PoolEndpoint *endpoints;
+    int endpoint_count;
+    PoolConnection *connections;
+    int connection_count;
+    int connections_per_endpoint;
+    int interval_ms;
+    int timeout_ms;
+    unsigned long long probe_count; // Probes per connection, 0 to probe until stopped
+    size_t probe_size;              // Bytes per probe, at least POOL_MIN_PROBE_SIZE, 0 for a short "probe N" line
+    bool fastopen;                  // Open connections with TCP Fast Open
+    int done_count;
+} ClientPool;
+
+int resolve_addresses(const char *host, const char *port, AddressList *addresses);
+void start_connect_attempt(ConnectAttempt *attempt, const AddressList *addresses, int epoll_fd, uint64_t tag, bool fastopen);
+int advance_connect_attempt(ConnectAttempt *attempt, int ready_slot, long long now_ms, int *socket_fd);
+void cancel_connect_attempt(ConnectAttempt *attempt);
+int connect_to_host(const char *host, const char *port, int timeout_ms, int *resolve_error);
+
+int init_client_pool(ClientPool *pool, int endpoint_count, int connections_per_endpoint);
+int add_pool_endpoint(ClientPool *pool, const char *host, const char *port);
+int run_client_pool(ClientPool *pool, int signal_fd);
+void print_pool_stats(const ClientPool *pool);
+void free_client_pool(ClientPool *pool);
+#endif
@@ -0,0 +1,374 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "utils.h"
+
+#define CONFIG_LINE_SIZE 256
+
+void init_default_config(ServerConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->max_clients = DEFAULT_MAX_CLIENTS;
+    config->max_events = DEFAULT_MAX_EVENTS;
+    config->buffer_size = DEFAULT_BUFFER_SIZE;
+    config->buffer_mode = BUFFER_MODE_FIXED;
+    config->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    config->log_level = LOG_LEVEL_INFO;
+    config->max_connections_per_ip = DEFAULT_MAX_CONNECTIONS_PER_IP;
+    config->accept_rate = DEFAULT_ACCEPT_RATE;
+    config->accept_burst = DEFAULT_ACCEPT_BURST;
+    config->bytes_rate = DEFAULT_BYTES_RATE;
+    config->bytes_burst = DEFAULT_BYTES_BURST;
+    config->workers = DEFAULT_WORKERS;
+    config->balance = BALANCE_CONNECTIONS;
+    config->zerocopy_threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+}
+
+/**
+ * @brief Parse a non-negative integer configuration value.
+ *
+ * @param[in] value_str The value as a string.
+ * @param[in] min The smallest accepted value.
+ * @param[out] value The parsed value.
+ * @return The status of the parsing.
+ * @retval 0 The value was successfully parsed.
+ * @retval -1 The value is not a number or is out of range.
+ */
+static int parse_uint(const char *value_str, unsigned int min, unsigned int *value)
+{
+    char *endptr;
+    errno = 0;
+    unsigned long parsed = strtoul(value_str, &endptr, 10);
+    if (endptr == value_str || *endptr != '\0' || errno == ERANGE || value_str[0] == '-' || parsed < min || parsed > INT_MAX)
+    {
+        return -1;
+    }
+    *value = (unsigned int)parsed;
+    return 0;
+}
+
+static int parse_log_level(const char *value_str, int *log_level)
+{
+    if (strcmp(value_str, "error") == 0)
+    {
+        *log_level = LOG_LEVEL_ERROR;
+    }
+    else if (strcmp(value_str, "info") == 0)
+    {
+        *log_level = LOG_LEVEL_INFO;
+    }
+    else if (strcmp(value_str, "debug") == 0)
+    {
+        *log_level = LOG_LEVEL_DEBUG;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_balance(const char *value_str, int *balance)
+{
+    if (strcmp(value_str, "connections") == 0)
+    {
+        *balance = BALANCE_CONNECTIONS;
+    }
+    else if (strcmp(value_str, "bytes") == 0)
+    {
+        *balance = BALANCE_BYTES;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_bool(const char *value_str, bool *value)
+{
+    if (strcmp(value_str, "yes") == 0)
+    {
+        *value = true;
+    }
+    else if (strcmp(value_str, "no") == 0)
+    {
+        *value = false;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_buffer_mode(const char *value_str, int *buffer_mode)
+{
+    if (strcmp(value_str, "fixed") == 0)
+    {
+        *buffer_mode = BUFFER_MODE_FIXED;
+    }
+    else if (strcmp(value_str, "lazy") == 0)
+    {
+        *buffer_mode = BUFFER_MODE_LAZY;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static const char *const socket_profile_names[SOCKET_PROFILE_COUNT] = {"default", "latency", "bulk"};
+
+static int parse_socket_profile(const char *value_str, int *profile)
+{
+    for (int i = 0; i < SOCKET_PROFILE_COUNT; i++)
+    {
+        if (strcmp(value_str, socket_profile_names[i]) == 0)
+        {
+            *profile = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static char *trim(char *str)
+{
+    while (isspace((unsigned char)*str))
+    {
+        str++;
+    }
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+    {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+/**
+ * @brief Load the server configuration from a file.
+ *
+ * The file consists of "key = value" lines. Empty lines and lines starting with '#' are ignored,
+ * and "port" may be given several times to listen on several ports, each optionally followed by
+ * the socket profile of its listeners ("port = 8080 latency"). Keys that are not in the file
+ * keep their default values. The configuration is only written if the whole file is valid.
+ *
+ * @param[in] path The path of the configuration file.
+ * @param[out] config The loaded configuration.
+ * @return The status of the loading.
+ * @retval 0 The configuration was successfully loaded.
+ * @retval -1 The file could not be read or is invalid.
+ */
+int load_config(const char *path, ServerConfig *config)
+{
+    FILE *file;
+    if ((file = fopen(path, "r")) == NULL)
+    {
+        perror("config: fopen()");
+        return -1;
+    }
+
+    ServerConfig loaded;
+    init_default_config(&loaded);
+
+    char line[CONFIG_LINE_SIZE];
+    int line_number = 0;
+    int result = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char *key = trim(line);
+        if (*key == '\0' || *key == '#')
+        {
+            continue;
+        }
+
+        char *separator;
+        if ((separator = strchr(key, '=')) == NULL)
+        {
+            printf("config: %s:%d: expected \"key = value\"\n", path, line_number);
+            result = -1;
+            break;
+        }
+        *separator = '\0';
+        key = trim(key);
+        char *value_str = trim(separator + 1);
+
+        unsigned int value = 0;
+        int parse_result = 0;
+        if (strcmp(key, "port") == 0)
+        {
+            // The port may be followed by the socket profile of its listeners
+            int port;
+            int profile = SOCKET_PROFILE_DEFAULT;
+            char *separator_pos = value_str + strcspn(value_str, " \t");
+            char separator = *separator_pos;
+            if (separator != '\0')
+            {
+                *separator_pos = '\0';
+                parse_result = parse_socket_profile(trim(separator_pos + 1), &profile);
+            }
+            port = parse_port(value_str);
+            *separator_pos = separator; // Keep the whole value for the error message
+            if (parse_result == -1 || port == -1)
+            {
+                parse_result = -1;
+            }
+            else if (config_has_port(&loaded, port))
+            {
+                // The same port may be repeated, but not with another profile
+                if (config_port_profile(&loaded, port) != profile)
+                {
+                    parse_result = -1;
+                }
+            }
+            else if (loaded.port_count == CONFIG_MAX_PORTS)
+            {
+                parse_result = -1;
+            }
+            else
+            {
+                loaded.ports[loaded.port_count] = port;
+                loaded.port_profiles[loaded.port_count++] = profile;
+            }
+        }
+        else if (strcmp(key, "log_level") == 0)
+        {
+            parse_result = parse_log_level(value_str, &loaded.log_level);
+        }
+        else if (strcmp(key, "balance") == 0)
+        {
+            parse_result = parse_balance(value_str, &loaded.balance);
+        }
+        else if (strcmp(key, "reuse_port") == 0)
+        {
+            parse_result = parse_bool(value_str, &loaded.reuse_port);
+        }
+        else if (strcmp(key, "buffer_mode") == 0)
+        {
+            parse_result = parse_buffer_mode(value_str, &loaded.buffer_mode);
+        }
+        else if (strcmp(key, "workers") == 0)
+        {
+            if ((parse_result = parse_uint(value_str, 0, &value)) == 0 && value > CONFIG_MAX_WORKERS)
+            {
+                parse_result = -1;
+            }
+            loaded.workers = (int)value;
+        }
+        else if (strcmp(key, "zerocopy_threshold") == 0)
+        {
+            parse_result = parse_uint(value_str, 0, &loaded.zerocopy_threshold);
+        }
+        else if (strcmp(key, "max_clients") == 0)
+        {
+            parse_result = parse_uint(value_str, 1, &value);
+            loaded.max_clients = (int)value;
+        }
+        else if (strcmp(key, "max_events") == 0)
+        {
+            parse_result = parse_uint(value_str, 1, &value);
+            loaded.max_events = (int)value;
+        }
+        else if (strcmp(key, "buffer_size") == 0)
+        {
+            parse_result = parse_uint(value_str, 1, &loaded.buffer_size);
+        }
+        else if (strcmp(key, "idle_timeout") == 0)
+        {
+            parse_result = parse_uint(value_str, 0, &loaded.idle_timeout);
+        }
+        else if (strcmp(key, "max_connections_per_ip") == 0)
+        {
+            parse_result = parse_uint(value_str, 0, &loaded.max_connections_per_ip);
+        }
+        else if (strcmp(key, "accept_rate") == 0)
+        {
+            parse_result = parse_uint(value_str, 0, &loaded.accept_rate);
+        }
+        else if (strcmp(key, "accept_burst") == 0)
+        {
+            parse_result = parse_uint(value_str, 1, &loaded.accept_burst);
+        }
+        else if (strcmp(key, "bytes_rate") == 0)
+        {
+            parse_result = parse_uint(value_str, 0, &loaded.bytes_rate);
+        }
+        else if (strcmp(key, "bytes_burst") == 0)
+        {
+            parse_result = parse_uint(value_str, 1, &loaded.bytes_burst);
+        }
+        else
+        {
+            printf("config: %s:%d: unknown key \"%s\"\n", path, line_number, key);
+            result = -1;
+            break;
+        }
+
+        if (parse_result == -1)
+        {
+            printf("config: %s:%d: invalid value for \"%s\": %s\n", path, line_number, key, value_str);
+            result = -1;
+            break;
+        }
+    }
+
+    if (result == 0 && ferror(file))
+    {
+        perror("config: fgets()");
+        result = -1;
+    }
+    fclose(file);
+
+    if (result == 0)
+    {
+        *config = loaded;
+    }
+    return result;
+}
+
+bool config_has_port(const ServerConfig *config, int port)
+{
+    for (int i = 0; i < config->port_count; i++)
+    {
+        if (config->ports[i] == port)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Get the socket profile of a configured port.
+ *
+ * @param[in] config The configuration.
+ * @param[in] port The port number.
+ * @return The SOCKET_PROFILE_* of the port, or -1 if the port is not configured.
+ */
+int config_port_profile(const ServerConfig *config, int port)
+{
+    for (int i = 0; i < config->port_count; i++)
+    {
+        if (config->ports[i] == port)
+        {
+            return config->port_profiles[i];
+        }
+    }
+    return -1;
+}
+
+const char *socket_profile_name(int profile)
+{
+    return profile >= 0 && profile < SOCKET_PROFILE_COUNT ? socket_profile_names[profile] : "unknown";
+}
@@ -0,0 +1,59 @@
+#include <stdbool.h>
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_MAX_PORTS 8
+#define CONFIG_MAX_WORKERS 64
+
+#define BALANCE_CONNECTIONS 0 // Hand new connections to the worker with the fewest connections
+#define BALANCE_BYTES 1       // Hand new connections to the worker with the fewest bytes in flight
+
+#define BUFFER_MODE_FIXED 0 // Every client keeps its own buffer while connected
+#define BUFFER_MODE_LAZY 1  // Clients only hold a buffer while a partial write is pending
+
+#define SOCKET_PROFILE_DEFAULT 0 // Kernel defaults
+#define SOCKET_PROFILE_LATENCY 1 // Small echoes sent and acknowledged right away
+#define SOCKET_PROFILE_BULK 2    // Large transfers with big socket buffers
+#define SOCKET_PROFILE_COUNT 3
+
+#define DEFAULT_MAX_CLIENTS 30
+#define DEFAULT_MAX_EVENTS 10
+#define DEFAULT_BUFFER_SIZE 256
+#define DEFAULT_IDLE_TIMEOUT 0 // Seconds, 0 to keep idle clients forever
+#define DEFAULT_MAX_CONNECTIONS_PER_IP 0 // 0 for unlimited, as are the rates below
+#define DEFAULT_ACCEPT_RATE 0            // Accepts per second per IP
+#define DEFAULT_ACCEPT_BURST 20
+#define DEFAULT_BYTES_RATE 0 // Bytes per second per connection
+#define DEFAULT_BYTES_BURST 131072
+#define DEFAULT_WORKERS 0 // 0 to serve clients on the accepting thread
+#define DEFAULT_ZEROCOPY_THRESHOLD 0 // Bytes, 0 to always copy on send
+
+typedef struct
+{
+    int ports[CONFIG_MAX_PORTS];
+    int port_profiles[CONFIG_MAX_PORTS]; // Socket profile of each port
+    int port_count;
+    int max_clients;
+    int max_events;
+    unsigned int buffer_size;
+    int buffer_mode;
+    unsigned int idle_timeout;
+    int log_level;
+    unsigned int max_connections_per_ip;
+    unsigned int accept_rate;
+    unsigned int accept_burst;
+    unsigned int bytes_rate;
+    unsigned int bytes_burst;
+    int workers;
+    int balance;
+    bool reuse_port; // Let other processes listen on the same ports with SO_REUSEPORT
+    unsigned int zerocopy_threshold;
+} ServerConfig;
+
+void init_default_config(ServerConfig *config);
+int load_config(const char *path, ServerConfig *config);
+bool config_has_port(const ServerConfig *config, int port);
+int config_port_profile(const ServerConfig *config, int port);
+const char *socket_profile_name(int profile);
+#endif
@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+#include "connection.h"
+#include "utils.h"
+
+static int handle_client_io(SocketData *client_socket_data, uint32_t events, const ServerConfig *config, const Transport *transport, char *scratch_buffer, long long now_ms);
+static int echo_from_scratch(SocketData *client_socket_data, const Transport *transport, const char *scratch_buffer, size_t len, long long now_ms);
+
+static ssize_t socket_recv(void *context, int socket_fd, void *buf, size_t len, int flags)
+{
+    (void)context;
+    return recv(socket_fd, buf, len, flags);
+}
+
+static ssize_t socket_send(void *context, int socket_fd, const void *buf, size_t len, int flags)
+{
+    (void)context;
+    return send(socket_fd, buf, len, flags);
+}
+
+static ssize_t socket_recvmsg(void *context, int socket_fd, struct msghdr *msg, int flags)
+{
+    (void)context;
+    return recvmsg(socket_fd, msg, flags);
+}
+
+static int socket_error(void *context, int socket_fd)
+{
+    (void)context;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+    {
+        return errno;
+    }
+    return error;
+}
+
+const Transport socket_transport = {
+    .recv = socket_recv,
+    .send = socket_send,
+    .recvmsg = socket_recvmsg,
+    .socket_error = socket_error,
+    .context = NULL,
+};
+
+/**
+ * @brief Handle the client socket
+ *
+ * This function handles communication with a connected client socket. It reads data from the client,
+ * processes it, and sends a response back to the client. The function continues to read and send data
+ * until the client disconnects or an error occurs.
+ *
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @param[in] events The epoll events reported for the client socket.
+ * @param[in] config The configuration of the event loop that owns the client.
+ * @param[in] transport The transport used to talk to the client.
+ * @param[in] scratch_buffer The receive buffer shared by the clients of the thread, at least as
+ * large as the buffer of the client. NULL if every client keeps a buffer of its own.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return The status of the client connection.
+ * @retval 1 The client is still connected.
+ * @retval 0 The client has disconnected.
+ * @retval -1 An error occurred during communication.
+ */
+int handle_client(SocketData *client_socket_data, uint32_t events, const ServerConfig *config, const Transport *transport, char *scratch_buffer, long long now_ms)
+{
+    int status = handle_client_io(client_socket_data, events, config, transport, scratch_buffer, now_ms);
+
+    // Give the buffer back once it has drained, unless the kernel may still read pinned bytes from it
+    if (scratch_buffer != NULL && client_socket_data->buffer != NULL && client_socket_data->pending_len == 0 &&
+        !(client_socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING))
+    {
+        free(client_socket_data->buffer);
+        client_socket_data->buffer = NULL;
+    }
+    return status;
+}
+
+/**
+ * @brief Echo bytes received into the scratch buffer straight back to the client.
+ *
+ * Only the bytes the socket does not take are kept, in a buffer allocated for the client.
+ *
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @param[in] transport The transport used to talk to the client.
+ * @param[in] scratch_buffer The scratch buffer holding the received bytes.
+ * @param[in] len The number of received bytes.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return The status of the process.
+ * @retval 0 The bytes were sent or kept.
+ * @retval -1 An error occurred during the process.
+ */
+static int echo_from_scratch(SocketData *client_socket_data, const Transport *transport, const char *scratch_buffer, size_t len, long long now_ms)
+{
+    ssize_t sent_bytes;
+    if ((sent_bytes = transport->send(transport->context, client_socket_data->socket_fd, scratch_buffer, len, 0)) == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            perror("connection: send()");
+            return -1;
+        }
+        sent_bytes = 0;
+    }
+    if (sent_bytes > 0)
+    {
+        client_socket_data->cold->bytes_sent += sent_bytes;
+        client_socket_data->cold->last_active_ms = now_ms;
+    }
+
+    if ((size_t)sent_bytes < len)
+    {
+        if ((client_socket_data->buffer = (char *)malloc(client_socket_data->buffer_size)) == NULL)
+        {
+            perror("connection: malloc()");
+            return -1;
+        }
+        memcpy(client_socket_data->buffer, scratch_buffer + sent_bytes, len - sent_bytes);
+        client_socket_data->pending_len = len - sent_bytes;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive from and send to a client socket, see handle_client().
+ */
+static int handle_client_io(SocketData *client_socket_data, uint32_t events, const ServerConfig *config, const Transport *transport, char *scratch_buffer, long long now_ms)
+{
+    // Completions of zerocopy sends and socket errors are reported as EPOLLERR. Reaping may turn
+    // zerocopy off, so whether a completion could have raised the error is decided beforehand.
+    bool zerocopy = client_socket_data->flags & (SOCKET_FLAG_ZEROCOPY | SOCKET_FLAG_ZEROCOPY_PENDING);
+    if ((events & EPOLLERR) && reap_zerocopy_completions(client_socket_data, transport) == -1)
+    {
+        return -1;
+    }
+
+    // EPOLLHUP and EPOLLERR are reported even while no events are wanted, for instance while the
+    // client is throttled with nothing pending, so they cannot wait for the next read or write.
+    // A hung up connection can no longer deliver anything, and outside of zerocopy completions
+    // an error that left no socket error behind is not going away either.
+    if (events & EPOLLHUP)
+    {
+        log_printf(LOG_LEVEL_INFO, "Connection hung up\n");
+        return 0;
+    }
+    if ((events & EPOLLERR) && !zerocopy)
+    {
+        log_printf(LOG_LEVEL_INFO, "Connection error\n");
+        return -1;
+    }
+
+    // Check if the client socket is ready to read and there is room left behind the pending data
+    if ((events & EPOLLIN) && client_socket_data->pending_len < client_socket_data->buffer_size)
+    {
+        // Never read more than the byte bucket allows, if the bytes are rate limited at all
+        size_t recv_len = client_socket_data->buffer_size - client_socket_data->pending_len;
+        unsigned int tokens = 0;
+        if (config->bytes_rate > 0)
+        {
+            tokens = token_bucket_refill(&client_socket_data->cold->byte_bucket, config->bytes_rate, config->bytes_burst, now_ms);
+            if (tokens < recv_len)
+            {
+                recv_len = tokens;
+            }
+        }
+
+        // Clients without a buffer of their own read into the scratch buffer
+        char *recv_buffer = client_socket_data->buffer != NULL ? client_socket_data->buffer + client_socket_data->pending_len : scratch_buffer;
+        if (recv_buffer == NULL)
+        {
+            if ((client_socket_data->buffer = (char *)malloc(client_socket_data->buffer_size)) == NULL)
+            {
+                perror("connection: malloc()");
+                return -1;
+            }
+            recv_buffer = client_socket_data->buffer;
+        }
+
+        ssize_t received_bytes;
+        if (recv_len == 0)
+        {
+            client_socket_data->flags |= SOCKET_FLAG_THROTTLED;
+        }
+        else if ((received_bytes = transport->recv(transport->context, client_socket_data->socket_fd, recv_buffer, recv_len, 0)) > 0)
+        {
+            log_printf(LOG_LEVEL_DEBUG, "received_bytes: %ld (fd: %d)\n", received_bytes, client_socket_data->socket_fd);
+            client_socket_data->cold->bytes_received += received_bytes;
+            client_socket_data->cold->last_active_ms = now_ms;
+            if (config->bytes_rate > 0)
+            {
+                token_bucket_take(&client_socket_data->cold->byte_bucket, received_bytes);
+                if ((size_t)received_bytes == tokens)
+                {
+                    client_socket_data->flags |= SOCKET_FLAG_THROTTLED;
+                }
+            }
+            if (recv_buffer == scratch_buffer)
+            {
+                // The echo has just been attempted, anything left is sent on EPOLLOUT
+                return echo_from_scratch(client_socket_data, transport, scratch_buffer, received_bytes, now_ms) == -1 ? -1 : 1;
+            }
+            client_socket_data->pending_len += received_bytes;
+        }
+        else if (received_bytes == 0)
+        {
+            log_printf(LOG_LEVEL_INFO, "Connection closed\n");
+            return 0;
+        }
+        else
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return 1;
+            }
+            perror("connection: recv()");
+            return -1;
+        }
+    }
+
+    // Check if the client socket is ready to write and there is data waiting to be sent
+    unsigned int sent_offset = (client_socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING) ? client_socket_data->cold->sent_offset : 0;
+    if ((events & EPOLLOUT) && client_socket_data->pending_len > sent_offset)
+    {
+        // Pinning pages only pays off for large payloads, smaller ones are copied as usual
+        size_t send_len = client_socket_data->pending_len - sent_offset;
+        int send_flags = 0;
+        if ((client_socket_data->flags & SOCKET_FLAG_ZEROCOPY) && config->zerocopy_threshold > 0 && send_len >= config->zerocopy_threshold)
+        {
+            send_flags = MSG_ZEROCOPY;
+        }
+
+        ssize_t sent_bytes;
+        while ((sent_bytes = transport->send(transport->context, client_socket_data->socket_fd, client_socket_data->buffer + sent_offset, send_len, send_flags)) == -1 && errno == ENOBUFS && send_flags != 0)
+        {
+            // The socket is out of memory for pinned pages, copy instead
+            send_flags = 0;
+        }
+        if (sent_bytes >= 0)
+        {
+            if (send_flags & MSG_ZEROCOPY)
+            {
+                client_socket_data->cold->zerocopy_issued++;
+                client_socket_data->flags |= SOCKET_FLAG_ZEROCOPY_PENDING;
+            }
+            if (client_socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING)
+            {
+                // The kernel may still read the sent bytes, so they stay in place until it releases them
+                client_socket_data->cold->sent_offset = sent_offset + sent_bytes;
+            }
+            else
+            {
+                memmove(client_socket_data->buffer, client_socket_data->buffer + sent_bytes, client_socket_data->pending_len - sent_bytes);
+                client_socket_data->pending_len -= sent_bytes;
+            }
+            client_socket_data->cold->bytes_sent += sent_bytes;
+            client_socket_data->cold->last_active_ms = now_ms;
+        }
+        else
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return 1;
+            }
+            perror("connection: send()");
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Reap the completion notifications of zerocopy sends.
+ *
+ * This function reads the notifications from the error queue of the client socket. Once the kernel
+ * has released every zerocopy send, the sent bytes are dropped from the buffer. If the kernel had
+ * to copy the data anyway, as it does on loopback, zerocopy is turned off for the socket. Other
+ * socket errors are reported as failures.
+ *
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @param[in] transport The transport used to talk to the client.
+ * @return The status of the process.
+ * @retval 0 The notifications were reaped.
+ * @retval -1 An error occurred on the socket.
+ */
+int reap_zerocopy_completions(SocketData *client_socket_data, const Transport *transport)
+{
+    while (client_socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (transport->recvmsg(transport->context, client_socket_data->socket_fd, &msg, MSG_ERRQUEUE) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            perror("connection: recvmsg(MSG_ERRQUEUE)");
+            return -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            // Each notification covers the range of sends [ee_info, ee_data]
+            client_socket_data->cold->zerocopy_completed += serr->ee_data - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                client_socket_data->flags &= ~SOCKET_FLAG_ZEROCOPY;
+            }
+        }
+
+        if (client_socket_data->cold->zerocopy_completed == client_socket_data->cold->zerocopy_issued)
+        {
+            unsigned int sent_offset = client_socket_data->cold->sent_offset;
+            memmove(client_socket_data->buffer, client_socket_data->buffer + sent_offset, client_socket_data->pending_len - sent_offset);
+            client_socket_data->pending_len -= sent_offset;
+            client_socket_data->cold->sent_offset = 0;
+            client_socket_data->flags &= ~SOCKET_FLAG_ZEROCOPY_PENDING;
+        }
+    }
+
+    int error;
+    if ((error = transport->socket_error(transport->context, client_socket_data->socket_fd)) != 0)
+    {
+        errno = error;
+        perror("connection: socket error");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the epoll events a client socket should be waiting for.
+ *
+ * Input is only wanted while there is room in the buffer and the client is not throttled, and
+ * output only while there is data waiting to be sent, so that level-triggered epoll does not keep
+ * reporting sockets that have nothing to do.
+ *
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @return The wanted events as SOCKET_FLAG_EPOLLIN and SOCKET_FLAG_EPOLLOUT.
+ */
+unsigned int get_client_events(const SocketData *client_socket_data)
+{
+    unsigned int flags = 0;
+    if (client_socket_data->pending_len < client_socket_data->buffer_size && !(client_socket_data->flags & SOCKET_FLAG_THROTTLED))
+    {
+        flags |= SOCKET_FLAG_EPOLLIN;
+    }
+    // Bytes pinned by zerocopy sends have been sent already, completions arrive as EPOLLERR
+    unsigned int sent_offset = (client_socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING) ? client_socket_data->cold->sent_offset : 0;
+    if (client_socket_data->pending_len > sent_offset)
+    {
+        flags |= SOCKET_FLAG_EPOLLOUT;
+    }
+    return flags;
+}
+
+/**
+ * @brief Lift the throttling of a client once its byte bucket has refilled.
+ *
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @param[in] config The configuration of the event loop that owns the client.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return Whether the client is still throttled.
+ */
+bool resume_client(SocketData *client_socket_data, const ServerConfig *config, long long now_ms)
+{
+    if (!(client_socket_data->flags & SOCKET_FLAG_THROTTLED))
+    {
+        return false;
+    }
+    if (token_bucket_refill(&client_socket_data->cold->byte_bucket, config->bytes_rate, config->bytes_burst, now_ms) == 0)
+    {
+        return true;
+    }
+    client_socket_data->flags &= ~SOCKET_FLAG_THROTTLED;
+    return false;
+}
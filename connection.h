@@ -0,0 +1,31 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "config.h"
+#include "utils.h"
+
+/**
+ * The calls handle_client() makes on a client socket. The server uses
+ * socket_transport, tests and tools can plug in an in-memory peer instead.
+ */
+typedef struct
+{
+    ssize_t (*recv)(void *context, int socket_fd, void *buf, size_t len, int flags);
+    ssize_t (*send)(void *context, int socket_fd, const void *buf, size_t len, int flags);
+    ssize_t (*recvmsg)(void *context, int socket_fd, struct msghdr *msg, int flags);
+    int (*socket_error)(void *context, int socket_fd); // Returns and clears the pending error, 0 if none
+    void *context;
+} Transport;
+
+extern const Transport socket_transport;
+
+int handle_client(SocketData *client_socket_data, uint32_t events, const ServerConfig *config, const Transport *transport, char *scratch_buffer, long long now_ms);
+int reap_zerocopy_completions(SocketData *client_socket_data, const Transport *transport);
+unsigned int get_client_events(const SocketData *client_socket_data);
+bool resume_client(SocketData *client_socket_data, const ServerConfig *config, long long now_ms);
+#endif
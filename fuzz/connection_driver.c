@@ -0,0 +1,708 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+#include "connection_driver.h"
+
+#define DRIVER_SOCKET_FD 3    // Never a real descriptor, the driver answers every call made on it
+#define DRIVER_IDLE_ROUNDS 3  // Rounds without progress before driver_drain() gives up
+#define DRIVER_DRAIN_TICK_MS 1000
+
+/**
+ * @brief Report a broken invariant and abort, so fuzzers record the input as a crash.
+ *
+ * @param[in] message The invariant that does not hold.
+ */
+static void driver_fail(const char *message)
+{
+    fprintf(stderr, "driver: %s\n", message);
+    abort();
+}
+
+/**
+ * @brief Append bytes to a growing buffer.
+ *
+ * @param[in,out] buffer The buffer.
+ * @param[in,out] len The number of bytes in the buffer.
+ * @param[in,out] cap The capacity of the buffer.
+ * @param[in] data The bytes to append.
+ * @param[in] data_len The number of bytes to append.
+ * @return The status of the process.
+ * @retval 0 The bytes were appended.
+ * @retval -1 The buffer could not be grown.
+ */
+static int append(char **buffer, size_t *len, size_t *cap, const char *data, size_t data_len)
+{
+    // The buffer is still NULL until the first bytes arrive, and memcpy() must not be given NULL
+    if (data_len == 0)
+    {
+        return 0;
+    }
+    if (*len + data_len > *cap)
+    {
+        size_t new_cap = *cap > 0 ? *cap : 4096;
+        while (new_cap < *len + data_len)
+        {
+            new_cap *= 2;
+        }
+        char *new_buffer = (char *)realloc(*buffer, new_cap);
+        if (new_buffer == NULL)
+        {
+            return -1;
+        }
+        *buffer = new_buffer;
+        *cap = new_cap;
+    }
+    memcpy(*buffer + *len, data, data_len);
+    *len += data_len;
+    return 0;
+}
+
+/**
+ * @brief Deliver bytes sent by the server to the peer.
+ *
+ * The peer must receive exactly what it wrote, so every delivered byte is checked against the
+ * inbound stream as it arrives.
+ *
+ * @param[in] driver The connection driver.
+ * @param[in] data The delivered bytes.
+ * @param[in] len The number of delivered bytes.
+ */
+static void deliver(ConnectionDriver *driver, const char *data, size_t len)
+{
+    if (driver->outbound_len + len > driver->inbound_pos)
+    {
+        driver_fail("the server sent more bytes than it received");
+    }
+    if (memcmp(data, driver->inbound + driver->outbound_len, len) != 0)
+    {
+        driver_fail("the echoed bytes differ from the received bytes");
+    }
+    if (append(&driver->outbound, &driver->outbound_len, &driver->outbound_cap, data, len) == -1)
+    {
+        driver_fail("out of memory");
+    }
+}
+
+/**
+ * @brief Deliver the sends at the front of the queue that are no longer waiting on zerocopy.
+ *
+ * @param[in] driver The connection driver.
+ * @param[in] count The number of zerocopy sends to release, 0 for all of them.
+ * @param[out] first The number of the first released zerocopy send.
+ * @param[out] last The number of the last released zerocopy send.
+ * @return The number of released zerocopy sends.
+ */
+static unsigned int flush_segments(ConnectionDriver *driver, unsigned int count, unsigned int *first, unsigned int *last)
+{
+    unsigned int released = 0;
+    unsigned int i = 0;
+    for (; i < driver->segment_count; i++)
+    {
+        DriverSegment *segment = &driver->segments[i];
+        if (segment->data != NULL)
+        {
+            if (count != 0 && released == count)
+            {
+                break;
+            }
+            // The emulated kernel reads pinned pages as late as it may, right before the release
+            if (memcmp(segment->data, segment->copy, segment->len) != 0)
+            {
+                driver_fail("bytes pinned by a zerocopy send were modified before its completion");
+            }
+            if (released == 0)
+            {
+                *first = segment->id;
+            }
+            *last = segment->id;
+            released++;
+            driver->zerocopy_in_flight--;
+        }
+        deliver(driver, segment->copy, segment->len);
+        free(segment->copy);
+    }
+    memmove(driver->segments, driver->segments + i, (driver->segment_count - i) * sizeof(DriverSegment));
+    driver->segment_count -= i;
+    return released;
+}
+
+static ssize_t driver_recv(void *context, int socket_fd, void *buf, size_t len, int flags)
+{
+    ConnectionDriver *driver = (ConnectionDriver *)context;
+    (void)socket_fd;
+    (void)flags;
+    if (driver->eintr)
+    {
+        driver->eintr = false;
+        errno = EINTR;
+        return -1;
+    }
+    if (driver->reset)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    size_t available = driver->inbound_len - driver->inbound_pos;
+    if (available == 0)
+    {
+        if (driver->fin)
+        {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len > available)
+    {
+        len = available;
+    }
+    if (driver->recv_chunk > 0 && len > driver->recv_chunk)
+    {
+        len = driver->recv_chunk;
+    }
+    memcpy(buf, driver->inbound + driver->inbound_pos, len);
+    driver->inbound_pos += len;
+    return len;
+}
+
+static ssize_t driver_send(void *context, int socket_fd, const void *buf, size_t len, int flags)
+{
+    ConnectionDriver *driver = (ConnectionDriver *)context;
+    (void)socket_fd;
+    if (driver->eintr)
+    {
+        driver->eintr = false;
+        errno = EINTR;
+        return -1;
+    }
+    if (driver->reset)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    if ((flags & MSG_ZEROCOPY) && driver->zerocopy_in_flight == DRIVER_MAX_ZEROCOPY)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (driver->send_window == 0 || driver->segment_count == DRIVER_MAX_SEGMENTS)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (len > driver->send_window)
+    {
+        len = driver->send_window;
+    }
+    driver->send_window -= len;
+
+    // Bytes queued behind a zerocopy send must wait for it to keep the stream in order
+    if ((flags & MSG_ZEROCOPY) || driver->segment_count > 0)
+    {
+        DriverSegment *segment = &driver->segments[driver->segment_count];
+        if ((segment->copy = (char *)malloc(len)) == NULL)
+        {
+            driver_fail("out of memory");
+        }
+        memcpy(segment->copy, buf, len);
+        segment->data = NULL;
+        segment->len = len;
+        if (flags & MSG_ZEROCOPY)
+        {
+            segment->data = (const char *)buf;
+            segment->id = driver->zerocopy_issued++;
+            driver->zerocopy_in_flight++;
+        }
+        driver->segment_count++;
+    }
+    else
+    {
+        deliver(driver, (const char *)buf, len);
+    }
+    return len;
+}
+
+static ssize_t driver_recvmsg(void *context, int socket_fd, struct msghdr *msg, int flags)
+{
+    ConnectionDriver *driver = (ConnectionDriver *)context;
+    (void)socket_fd;
+    if (driver->eintr)
+    {
+        driver->eintr = false;
+        errno = EINTR;
+        return -1;
+    }
+    if (!(flags & MSG_ERRQUEUE) || driver->notification_count == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    DriverNotification notification = driver->notifications[0];
+    memmove(driver->notifications, driver->notifications + 1, (driver->notification_count - 1) * sizeof(DriverNotification));
+    driver->notification_count--;
+
+    msg->msg_flags = 0;
+    if (msg->msg_controllen < CMSG_SPACE(sizeof(struct sock_extended_err)))
+    {
+        msg->msg_controllen = 0;
+        msg->msg_flags |= MSG_CTRUNC;
+        return 0;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_IP;
+    cmsg->cmsg_type = IP_RECVERR;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct sock_extended_err));
+    struct sock_extended_err serr;
+    memset(&serr, 0, sizeof(serr));
+    serr.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+    serr.ee_info = notification.first;
+    serr.ee_data = notification.last;
+    serr.ee_code = notification.copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+    memcpy(CMSG_DATA(cmsg), &serr, sizeof(serr));
+    msg->msg_controllen = CMSG_SPACE(sizeof(struct sock_extended_err));
+    return 0;
+}
+
+static int driver_socket_error(void *context, int socket_fd)
+{
+    ConnectionDriver *driver = (ConnectionDriver *)context;
+    (void)socket_fd;
+    return driver->reset ? ECONNRESET : 0;
+}
+
+/**
+ * @brief Initialize a driver with a freshly accepted connection.
+ *
+ * @param[out] driver The connection driver.
+ * @param[in] config The configuration the connection is handled with.
+ * @param[in] zerocopy Whether the connection may use MSG_ZEROCOPY.
+ * @return The status of the process.
+ * @retval 0 The driver was successfully initialized.
+ * @retval -1 An error occurred during the process.
+ */
+int init_connection_driver(ConnectionDriver *driver, const ServerConfig *config, bool zerocopy)
+{
+    memset(driver, 0, sizeof(*driver));
+    driver->config = *config;
+    driver->status = 1;
+    driver->transport.recv = driver_recv;
+    driver->transport.send = driver_send;
+    driver->transport.recvmsg = driver_recvmsg;
+    driver->transport.socket_error = driver_socket_error;
+    driver->transport.context = driver;
+
+    if (init_socket_manager(&driver->manager, 1, config->buffer_size) == -1)
+    {
+        return -1;
+    }
+    driver->manager.lazy_buffers = config->buffer_mode == BUFFER_MODE_LAZY;
+    // Exactly as large as the client buffer, so that overruns are caught by the sanitizers
+    if (driver->manager.lazy_buffers && (driver->scratch_buffer = (char *)malloc(config->buffer_size)) == NULL)
+    {
+        return -1;
+    }
+    int index;
+    if ((index = add_socket(&driver->manager, DRIVER_SOCKET_FD)) == -1)
+    {
+        close_all_sockets(&driver->manager);
+        free(driver->scratch_buffer);
+        return -1;
+    }
+    driver->socket_data = get_socket(&driver->manager, index);
+    token_bucket_init(&driver->socket_data->cold->byte_bucket, config->bytes_burst, driver->now_ms);
+    if (zerocopy)
+    {
+        driver->socket_data->flags |= SOCKET_FLAG_ZEROCOPY;
+    }
+    return 0;
+}
+
+void free_connection_driver(ConnectionDriver *driver)
+{
+    for (unsigned int i = 0; i < driver->segment_count; i++)
+    {
+        free(driver->segments[i].copy);
+    }
+    // The descriptor is not real, so it is removed before the manager would close it
+    remove_socket(&driver->manager, DRIVER_SOCKET_FD);
+    close_all_sockets(&driver->manager);
+    free(driver->scratch_buffer);
+    free(driver->inbound);
+    free(driver->outbound);
+    memset(driver, 0, sizeof(*driver));
+}
+
+/**
+ * @brief Make the peer write bytes to the server.
+ *
+ * @param[in] driver The connection driver.
+ * @param[in] data The bytes to write.
+ * @param[in] len The number of bytes to write.
+ * @return The status of the process.
+ * @retval 0 The bytes were queued for the server.
+ * @retval -1 The peer has already shut down or reset the connection.
+ */
+int driver_write(ConnectionDriver *driver, const char *data, size_t len)
+{
+    if (driver->fin || driver->reset)
+    {
+        return -1;
+    }
+    if (append(&driver->inbound, &driver->inbound_len, &driver->inbound_cap, data, len) == -1)
+    {
+        driver_fail("out of memory");
+    }
+    return 0;
+}
+
+/**
+ * @brief Run one iteration of the event loop for the connection.
+ *
+ * Like level-triggered epoll, only the events the connection is registered for and that are
+ * ready are reported, while errors are always reported. A spurious step reports every registered
+ * event whether it is ready or not.
+ *
+ * @param[in] driver The connection driver.
+ * @param[in] spurious Whether to report events that are not ready.
+ * @return The status of the connection as returned by handle_client().
+ */
+int driver_step(ConnectionDriver *driver, bool spurious)
+{
+    if (driver->status != 1)
+    {
+        return driver->status;
+    }
+
+    SocketData *socket_data = driver->socket_data;
+    resume_client(socket_data, &driver->config, driver->now_ms);
+    unsigned int wanted = get_client_events(socket_data);
+    bool readable = driver->inbound_pos < driver->inbound_len || driver->fin || driver->reset;
+    bool writable = driver->send_window > 0 || driver->reset;
+
+    uint32_t events = 0;
+    if ((wanted & SOCKET_FLAG_EPOLLIN) && (readable || spurious))
+    {
+        events |= EPOLLIN;
+    }
+    if ((wanted & SOCKET_FLAG_EPOLLOUT) && (writable || spurious))
+    {
+        events |= EPOLLOUT;
+    }
+    if (driver->notification_count > 0 || driver->reset)
+    {
+        events |= EPOLLERR;
+    }
+    if (driver->reset)
+    {
+        events |= EPOLLHUP;
+    }
+    if (events == 0)
+    {
+        return driver->status;
+    }
+
+    driver->steps++;
+    driver->status = handle_client(socket_data, events, &driver->config, &driver->transport, driver->scratch_buffer, driver->now_ms);
+    driver_check(driver);
+    return driver->status;
+}
+
+/**
+ * @brief Make the emulated kernel release zerocopy sends.
+ *
+ * @param[in] driver The connection driver.
+ * @param[in] count The number of sends to release, 0 for all of them.
+ * @param[in] copied Whether to report that the kernel copied the data anyway.
+ */
+void driver_complete_zerocopy(ConnectionDriver *driver, unsigned int count, bool copied)
+{
+    unsigned int first = 0;
+    unsigned int last = 0;
+    if (driver->zerocopy_in_flight == 0 || flush_segments(driver, count, &first, &last) == 0)
+    {
+        return;
+    }
+
+    // A full error queue merges ranges, the kernel coalesces consecutive notifications the same way
+    if (driver->notification_count == DRIVER_MAX_NOTIFICATIONS)
+    {
+        DriverNotification *notification = &driver->notifications[driver->notification_count - 1];
+        notification->last = last;
+        notification->copied |= copied;
+        return;
+    }
+    DriverNotification *notification = &driver->notifications[driver->notification_count++];
+    notification->first = first;
+    notification->last = last;
+    notification->copied = copied;
+}
+
+/**
+ * @brief Let the connection run with an unlimited window until it makes no more progress.
+ *
+ * Unless the peer shut down or reset the connection, everything it wrote must have been echoed
+ * back once the connection goes quiet. Time advances on every round so throttled connections
+ * keep going.
+ *
+ * @param[in] driver The connection driver.
+ * @return The status of the connection as returned by handle_client().
+ */
+int driver_drain(ConnectionDriver *driver)
+{
+    int idle_rounds = 0;
+    while (driver->status == 1 && idle_rounds < DRIVER_IDLE_ROUNDS)
+    {
+        size_t inbound_pos = driver->inbound_pos;
+        size_t outbound_len = driver->outbound_len;
+        unsigned int pending_len = driver->socket_data->pending_len;
+        unsigned int flags = driver->socket_data->flags;
+
+        driver->send_window = SIZE_MAX;
+        driver_complete_zerocopy(driver, 0, false);
+        driver->now_ms += DRIVER_DRAIN_TICK_MS;
+        driver_step(driver, false);
+
+        bool progress = driver->inbound_pos != inbound_pos || driver->outbound_len != outbound_len ||
+                        driver->socket_data->pending_len != pending_len || driver->socket_data->flags != flags;
+        idle_rounds = progress ? 0 : idle_rounds + 1;
+    }
+
+    if (driver->status == 1 && !driver->fin && !driver->reset &&
+        (driver->inbound_pos != driver->inbound_len || driver->outbound_len != driver->inbound_len))
+    {
+        driver_fail("the connection stalled before echoing everything it received");
+    }
+    return driver->status;
+}
+
+/**
+ * @brief Check the invariants of the connection state, aborting if one does not hold.
+ *
+ * @param[in] driver The connection driver.
+ */
+void driver_check(const ConnectionDriver *driver)
+{
+    const SocketData *socket_data = driver->socket_data;
+    const SocketColdData *cold = socket_data->cold;
+    if (socket_data->pending_len > socket_data->buffer_size)
+    {
+        driver_fail("pending_len exceeds the buffer size");
+    }
+    if (socket_data->buffer == NULL && socket_data->pending_len > 0)
+    {
+        driver_fail("bytes are pending without a buffer");
+    }
+    if (driver->scratch_buffer != NULL && socket_data->buffer != NULL && socket_data->pending_len == 0 &&
+        !(socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING))
+    {
+        driver_fail("an idle lazily buffered connection kept its buffer");
+    }
+
+    unsigned int sent_offset = 0;
+    if (socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING)
+    {
+        sent_offset = cold->sent_offset;
+        if (sent_offset > socket_data->pending_len)
+        {
+            driver_fail("sent_offset exceeds pending_len");
+        }
+    }
+    else if (cold->sent_offset != 0)
+    {
+        driver_fail("sent_offset is set without zerocopy sends in flight");
+    }
+
+    if (cold->bytes_received != driver->inbound_pos)
+    {
+        driver_fail("bytes_received does not match the bytes read from the peer");
+    }
+    size_t queued = 0;
+    for (unsigned int i = 0; i < driver->segment_count; i++)
+    {
+        queued += driver->segments[i].len;
+    }
+    if (cold->bytes_sent != driver->outbound_len + queued)
+    {
+        driver_fail("bytes_sent does not match the bytes handed to the peer");
+    }
+    if (cold->bytes_received != cold->bytes_sent + (socket_data->pending_len - sent_offset))
+    {
+        driver_fail("received bytes were lost or duplicated in the buffer");
+    }
+
+    // The buffer holds the pinned bytes followed by the unsent ones, in stream order
+    size_t buffer_start = cold->bytes_sent - sent_offset;
+    if (socket_data->pending_len > 0 && memcmp(socket_data->buffer, driver->inbound + buffer_start, socket_data->pending_len) != 0)
+    {
+        driver_fail("the buffer does not hold the bytes waiting to be sent");
+    }
+}
+
+/**
+ * @brief Run a driver script against a fresh connection.
+ *
+ * A script starts with five header bytes: the buffer size, the zerocopy threshold, the byte rate,
+ * the byte burst and the buffer mode. Each following byte picks an operation, some of which take the next byte as
+ * their argument:
+ *
+ * - 0 n: the peer writes the next n + 1 bytes of the script
+ * - 1 n: the send window grows by n * 16 + 1 bytes
+ * - 2 n: recv() hands out at most n bytes at a time, 0 for no limit
+ * - 3:   the next call fails with EINTR
+ * - 4:   the peer shuts down its side
+ * - 5:   the peer resets the connection
+ * - 6:   one iteration of the event loop
+ * - 7:   one iteration of the event loop with spurious events
+ * - 8 n: zerocopy sends are released, (n >> 1) & 7 of them or all for 0, copied if n & 1
+ * - 9 n: time advances by n * 10 milliseconds
+ *
+ * Once the script is done the connection is drained and checked.
+ *
+ * @param[in] data The script.
+ * @param[in] size The size of the script.
+ * @return The status of the process.
+ * @retval 0 The script ran and every invariant held.
+ * @retval -1 The driver could not be initialized.
+ */
+int run_driver_script(const unsigned char *data, size_t size)
+{
+    if (size < 5)
+    {
+        return 0;
+    }
+
+    ServerConfig config;
+    init_default_config(&config);
+    config.buffer_size = 1 + data[0] * 8;
+    config.zerocopy_threshold = data[1];
+    config.bytes_rate = data[2] * 64;
+    config.bytes_burst = 1 + data[3] * 16;
+    config.buffer_mode = data[4] & 1 ? BUFFER_MODE_LAZY : BUFFER_MODE_FIXED;
+
+    ConnectionDriver driver;
+    if (init_connection_driver(&driver, &config, config.zerocopy_threshold > 0) == -1)
+    {
+        return -1;
+    }
+
+    size_t pos = 5;
+    while (pos < size && driver.status == 1)
+    {
+        unsigned char op = data[pos++] % 10;
+        unsigned char arg = 0;
+        if (op == 0 || op == 1 || op == 2 || op == 8 || op == 9)
+        {
+            arg = pos < size ? data[pos++] : 0;
+        }
+
+        switch (op)
+        {
+        case 0:
+        {
+            size_t len = (size_t)arg + 1;
+            if (len > size - pos)
+            {
+                len = size - pos;
+            }
+            driver_write(&driver, (const char *)data + pos, len);
+            pos += len;
+            break;
+        }
+        case 1:
+            driver.send_window += (size_t)arg * 16 + 1;
+            break;
+        case 2:
+            driver.recv_chunk = arg;
+            break;
+        case 3:
+            driver.eintr = true;
+            break;
+        case 4:
+            driver.fin = true;
+            break;
+        case 5:
+            driver.reset = true;
+            break;
+        case 6:
+            driver_step(&driver, false);
+            break;
+        case 7:
+            driver_step(&driver, true);
+            break;
+        case 8:
+            driver_complete_zerocopy(&driver, (arg >> 1) & 7, arg & 1);
+            break;
+        case 9:
+            driver.now_ms += arg * 10;
+            break;
+        }
+    }
+
+    driver_drain(&driver);
+    free_connection_driver(&driver);
+    return 0;
+}
+
+/**
+ * @brief Read a whole input file into memory.
+ *
+ * @param[in] path The path of the file, "-" for standard input.
+ * @param[out] size The size of the file.
+ * @return The contents of the file, to be freed by the caller, or NULL on failure.
+ */
+unsigned char *read_input_file(const char *path, size_t *size)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror("fopen()");
+        return NULL;
+    }
+
+    unsigned char *data = NULL;
+    size_t cap = 0;
+    size_t read_bytes;
+    *size = 0;
+    do
+    {
+        if (*size == cap)
+        {
+            cap = cap > 0 ? cap * 2 : 4096;
+            unsigned char *new_data = (unsigned char *)realloc(data, cap);
+            if (new_data == NULL)
+            {
+                perror("realloc()");
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = new_data;
+        }
+        read_bytes = fread(data + *size, 1, cap - *size, file);
+        *size += read_bytes;
+    } while (read_bytes > 0);
+
+    if (data != NULL && ferror(file))
+    {
+        perror("fread()");
+        free(data);
+        data = NULL;
+    }
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    return data;
+}
@@ -0,0 +1,85 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef CONNECTION_DRIVER_H
+#define CONNECTION_DRIVER_H
+
+#include "config.h"
+#include "connection.h"
+#include "utils.h"
+
+#define DRIVER_MAX_ZEROCOPY 8       // Zerocopy sends in flight before send() fails with ENOBUFS
+#define DRIVER_MAX_NOTIFICATIONS 8  // Completion notifications queued on the error queue
+#define DRIVER_MAX_SEGMENTS 64      // Sends queued behind a zerocopy send before send() returns EAGAIN
+
+/**
+ * A send the peer has not received yet. Copied sends own their bytes, zerocopy sends only point
+ * into the connection buffer and are read when the emulated kernel releases them.
+ */
+typedef struct
+{
+    const char *data;  // Pinned bytes in the connection buffer, NULL for copied sends
+    char *copy;        // Bytes as they were at send time
+    size_t len;
+    unsigned int id;   // Zerocopy send number, as the kernel counts them
+} DriverSegment;
+
+typedef struct
+{
+    unsigned int first;
+    unsigned int last;
+    bool copied;
+} DriverNotification;
+
+/**
+ * An in-memory peer for a single connection. It stands in for the socket behind a Transport and
+ * drives handle_client() the way the event loop does, one level-triggered readiness report at a
+ * time, while checking that the echoed stream stays intact.
+ */
+typedef struct
+{
+    // Bytes written by the peer, consumed by the server from inbound_pos
+    char *inbound;
+    size_t inbound_len;
+    size_t inbound_cap;
+    size_t inbound_pos;
+
+    // Bytes the peer has received from the server
+    char *outbound;
+    size_t outbound_len;
+    size_t outbound_cap;
+
+    size_t send_window; // Bytes the server may send before send() returns EAGAIN
+    size_t recv_chunk;  // Largest read handed out by recv(), 0 for no limit
+    bool fin;           // The peer has shut down its side, recv() returns 0 once inbound is drained
+    bool reset;         // The peer has reset the connection
+    bool eintr;         // The next call fails with EINTR
+
+    DriverSegment segments[DRIVER_MAX_SEGMENTS];
+    unsigned int segment_count;
+    unsigned int zerocopy_in_flight;
+    unsigned int zerocopy_issued;
+    DriverNotification notifications[DRIVER_MAX_NOTIFICATIONS];
+    unsigned int notification_count;
+
+    long long now_ms;
+    int status; // Last value returned by handle_client()
+    unsigned long long steps;
+
+    ServerConfig config;
+    char *scratch_buffer; // Only allocated for BUFFER_MODE_LAZY
+    SocketManager manager;
+    SocketData *socket_data;
+    Transport transport;
+} ConnectionDriver;
+
+int init_connection_driver(ConnectionDriver *driver, const ServerConfig *config, bool zerocopy);
+void free_connection_driver(ConnectionDriver *driver);
+int driver_write(ConnectionDriver *driver, const char *data, size_t len);
+int driver_step(ConnectionDriver *driver, bool spurious);
+void driver_complete_zerocopy(ConnectionDriver *driver, unsigned int count, bool copied);
+int driver_drain(ConnectionDriver *driver);
+void driver_check(const ConnectionDriver *driver);
+int run_driver_script(const unsigned char *data, size_t size);
+unsigned char *read_input_file(const char *path, size_t *size);
+#endif
@@ -0,0 +1,41 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "connection_driver.h"
+
+/**
+ * Fuzz target for handle_client(). Every input is a driver script, see run_driver_script() for
+ * the format. Broken invariants abort, so libFuzzer and AFL report them as crashes.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    atomic_store(&log_level, LOG_LEVEL_ERROR);
+    run_driver_script(data, size);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/**
+ * @brief Run the fuzz target on files, or on standard input without arguments.
+ *
+ * This is the entry point AFL runs, and reproduces crashes without libFuzzer.
+ */
+int main(int argc, char *argv[])
+{
+    int status = 0;
+    for (int i = 1; i < argc || i == 1; i++)
+    {
+        size_t size;
+        unsigned char *data;
+        if ((data = read_input_file(argc > 1 ? argv[i] : "-", &size)) == NULL)
+        {
+            status = 1;
+            continue;
+        }
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    return status;
+}
+#endif
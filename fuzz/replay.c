@@ -0,0 +1,207 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection_driver.h"
+
+#define DEFAULT_CHUNK_SIZE 1448 // Payload of a full TCP segment on Ethernet
+#define DEFAULT_ITERATIONS 1
+
+/**
+ * @brief Replay a capture through handle_client() as fast as it will go.
+ *
+ * The capture is the byte stream a peer sent, written to the connection in chunks. Every chunk is
+ * consumed and echoed before the next one arrives, and the echo is checked on the way.
+ *
+ * @param[in] data The capture.
+ * @param[in] size The size of the capture.
+ * @param[in] config The configuration the connection is handled with.
+ * @param[in] chunk_size The number of bytes the peer writes at once.
+ * @param[out] steps The number of event loop iterations it took.
+ * @return The status of the process.
+ * @retval 0 The capture was echoed back intact.
+ * @retval -1 The connection could not be set up or closed early.
+ */
+static int replay_capture(const unsigned char *data, size_t size, const ServerConfig *config, size_t chunk_size, unsigned long long *steps)
+{
+    ConnectionDriver driver;
+    if (init_connection_driver(&driver, config, false) == -1)
+    {
+        return -1;
+    }
+    driver.send_window = SIZE_MAX;
+
+    for (size_t pos = 0; pos < size && driver.status == 1; pos += chunk_size)
+    {
+        size_t len = size - pos < chunk_size ? size - pos : chunk_size;
+        driver_write(&driver, (const char *)data + pos, len);
+        while (driver.status == 1 && (driver.inbound_pos < driver.inbound_len || driver.socket_data->pending_len > 0))
+        {
+            size_t inbound_pos = driver.inbound_pos;
+            size_t outbound_len = driver.outbound_len;
+            driver_step(&driver, false);
+            if (driver.inbound_pos == inbound_pos && driver.outbound_len == outbound_len)
+            {
+                break; // Throttled or stalled, driver_drain() sorts it out
+            }
+        }
+    }
+
+    int status = driver_drain(&driver);
+    *steps += driver.steps;
+    free_connection_driver(&driver);
+    return status == 1 ? 0 : -1;
+}
+
+/**
+ * @brief Measure the user-space memory the socket table takes for idle connections.
+ *
+ * The descriptors are not real, so no sockets are opened and any number of connections fits.
+ *
+ * @param[in] config The configuration the connections are handled with.
+ * @param[in] connections The number of idle connections.
+ * @return The status of the process.
+ * @retval 0 The memory was measured.
+ * @retval -1 An error occurred during the process.
+ */
+static int measure_idle_memory(const ServerConfig *config, int connections)
+{
+    long long rss_before = resident_set_size();
+    SocketManager manager;
+    init_socket_manager(&manager, connections, config->buffer_size);
+    manager.lazy_buffers = config->buffer_mode == BUFFER_MODE_LAZY;
+
+    int result = 0;
+    for (int fd = 0; fd < connections; fd++)
+    {
+        if (add_socket(&manager, fd) == -1)
+        {
+            fprintf(stderr, "replay: failed to add connection %d\n", fd);
+            result = -1;
+            break;
+        }
+    }
+    long long rss_after = resident_set_size();
+    if (result == 0 && rss_before != -1 && rss_after != -1)
+    {
+        printf("%d idle connections with %s buffers: %lld KiB RSS, %.0f bytes/connection\n", connections,
+               manager.lazy_buffers ? "lazy" : "fixed", rss_after / 1024, (double)(rss_after - rss_before) / connections);
+    }
+
+    // The descriptors are not real, so they are removed before the manager would close them
+    for (int fd = 0; fd < connections; fd++)
+    {
+        remove_socket(&manager, fd);
+    }
+    close_all_sockets(&manager);
+    return result;
+}
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: replay [-s] [-l] [-b buffer_size] [-c chunk_size] [-n iterations] <file>...\n");
+    fprintf(stderr, "       replay [-l] [-b buffer_size] -m connections\n");
+    fprintf(stderr, "  -s  the files are driver scripts instead of captures\n");
+    fprintf(stderr, "  -l  lazy buffers, see buffer_mode\n");
+    fprintf(stderr, "  -m  measure the memory of idle connections instead\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bool scripts = false;
+    size_t chunk_size = DEFAULT_CHUNK_SIZE;
+    long iterations = DEFAULT_ITERATIONS;
+    int idle_connections = 0;
+    ServerConfig config;
+    init_default_config(&config);
+    config.bytes_rate = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "slb:c:n:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            scripts = true;
+            break;
+        case 'l':
+            config.buffer_mode = BUFFER_MODE_LAZY;
+            break;
+        case 'm':
+            idle_connections = atoi(optarg);
+            break;
+        case 'b':
+            config.buffer_size = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            chunk_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (idle_connections > 0)
+    {
+        return measure_idle_memory(&config, idle_connections) == -1 ? 1 : 0;
+    }
+    if (optind == argc || config.buffer_size == 0 || chunk_size == 0 || iterations <= 0)
+    {
+        usage();
+        return 1;
+    }
+    atomic_store(&log_level, LOG_LEVEL_ERROR);
+
+    int status = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        size_t size;
+        unsigned char *data;
+        if ((data = read_input_file(argv[i], &size)) == NULL)
+        {
+            status = 1;
+            continue;
+        }
+
+        unsigned long long steps = 0;
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long n = 0; n < iterations; n++)
+        {
+            int result = scripts ? run_driver_script(data, size) : replay_capture(data, size, &config, chunk_size, &steps);
+            if (result == -1)
+            {
+                fprintf(stderr, "replay: %s: the connection closed before the capture was echoed\n", argv[i]);
+                status = 1;
+                break;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed_seconds(&start, &end);
+        double total_bytes = (double)size * iterations;
+        if (scripts)
+        {
+            printf("%s: %ld runs in %.3f s, %.0f ns/run\n", argv[i], iterations, seconds, seconds * 1e9 / iterations);
+        }
+        else if (total_bytes > 0)
+        {
+            printf("%s: %zu bytes x %ld in %.3f s, %.1f MB/s, %.2f ns/byte, %.1f bytes/step\n", argv[i], size, iterations, seconds,
+                   total_bytes / seconds / 1e6, seconds * 1e9 / total_bytes, steps > 0 ? total_bytes / steps : 0.0);
+        }
+        free(data);
+    }
+    return status;
+}
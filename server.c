@@ -2,173 +2,238 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "config.h"
+#include "connection.h"
+#include "socket_profile.h"
+#include "task_queue.h"
 #include "utils.h"
 
-#define BUFFER_SIZE 256
 #define MAX_LISTENS 20
-#define MAX_CLIENTS 30
-#define MAX_EVENTS 10
+#define THROTTLE_CHECK_MS 100    // Longest wait before throttled connections are checked for refilled buckets
+#define IDLE_CHECK_MS 1000       // How often connections are checked for the idle timeout
+#define CLOSING_CHECK_MS 100     // How often closing connections are checked for the linger timeout
+#define ZEROCOPY_LINGER_MS 10000 // How long a closing connection may wait for its zerocopy sends without progress
 
-int pipe_fds[2];
+/**
+ * State of one event loop. The main thread runs a loop for the listening sockets and signals,
+ * which also serves the clients when there are no workers. Otherwise each worker thread runs its
+ * own loop and the main thread only accepts connections and hands them over.
+ */
+typedef struct
+{
+    int id;
+    int epoll_fd;
+    SocketManager client_socket_manager;
+    TaskQueue task_queue;
+    struct epoll_event *events;
+    char *scratch_buffer; // Receive buffer shared by the clients that have no buffer of their own
+    unsigned int scratch_size;
+    ServerConfig config; // Only touched by the thread of the loop, workers receive changes as tasks
+    bool has_throttled_clients;
+    long long next_resume_ms; // When the first byte bucket of a throttled client is full again
+    int closing_clients; // Clients waiting for their zerocopy sends to complete before being closed
+    long long last_idle_check_ms;
+    unsigned long long pending_bytes;
+    pthread_t thread;
+    atomic_bool stopping;
+    Task stats_task;               // Submitted by the main thread to make a worker print its statistics
+    atomic_bool stats_requested;   // The stats task is queued, so it must not be submitted again
+    _Alignas(CACHE_LINE_SIZE) atomic_int connections; // Also written by the acceptor, so kept on its own line
+    atomic_ullong bytes_in_flight;
+} EventLoop;
+
+typedef struct
+{
+    Task task;
+    EventLoop *loop;
+    int socket_fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int profile;
+    bool admitted; // Counted in the admission table, the record then stays with the connection to release it
+} NewConnection;
+
+typedef struct
+{
+    Task task;
+    EventLoop *loop;
+    ServerConfig config;
+} ConfigUpdate;
 
-int create_listen_sockets(const char *port_str, SocketManager *listen_socket_manager);
+int signal_fd = -1;
+ServerConfig server_config;
+const char *config_path = NULL;
+AdmissionTable admission_table;
+EventLoop main_loop;
+EventLoop *workers = NULL;
+int worker_count = 0;
+
+int create_listen_sockets(const char *port_str, int profile, bool reuse_port, SocketManager *listen_socket_manager);
 int add_listen_sockets_to_epoll(int epoll_fd, SocketManager *listen_socket_manager);
-int add_pipe_to_epoll(int epoll_fd);
-int handle_new_connection(int listen_socket_fd, int epoll_fd, SocketManager *client_socket_manager);
-int handle_client(SocketData *client_socket_data, struct epoll_event event);
-void handle_sigint(int sig);
+int update_listen_sockets(int epoll_fd, SocketManager *listen_socket_manager, const ServerConfig *config);
+int add_signalfd_to_epoll(int epoll_fd);
+int add_task_queue_to_epoll(int epoll_fd, TaskQueue *task_queue);
+int init_event_loop(EventLoop *loop, int id, const ServerConfig *config, int max_clients);
+void free_event_loop(EventLoop *loop);
+int grow_scratch_buffer(EventLoop *loop, unsigned int buffer_size);
+int run_event_loop(EventLoop *loop, SocketManager *listen_socket_manager);
+void *run_worker(void *arg);
+int start_workers(const ServerConfig *config);
+void stop_workers(void);
+int handle_new_connection(int listen_socket_fd, int profile);
+int register_client(EventLoop *loop, int conn_socket_fd, const struct sockaddr_storage *client_addr, socklen_t addr_len, int profile, bool admitted, NewConnection *record);
+void register_client_task(void *arg);
+void discard_new_connection(void *arg);
+EventLoop *pick_worker(void);
+void release_admission(EventLoop *loop, const struct sockaddr_storage *addr, NewConnection *record);
+void release_admission_task(void *arg);
+int update_client_events(int epoll_fd, SocketData *client_socket_data);
+int resume_throttled_clients(EventLoop *loop);
+void close_client(EventLoop *loop, SocketData *client_socket_data);
+int linger_client(EventLoop *loop, SocketData *client_socket_data);
+void handle_closing_client(EventLoop *loop, SocketData *client_socket_data);
+void close_lingering_clients(EventLoop *loop);
+void close_idle_clients(EventLoop *loop);
+int reload_config(SocketManager *listen_socket_manager);
+int apply_config(EventLoop *loop, const ServerConfig *config, int max_clients);
+void apply_config_task(void *arg);
+int worker_max_clients(const ServerConfig *config, int index);
+int get_socket_port(const struct sockaddr_storage *addr);
+void print_stats(EventLoop *loop);
+void print_stats_task(void *arg);
+void request_stats(void);
 
 int main(int argc, char **argv)
 {
     // Declare variables that need to be cleaned up later
-    int epoll_fd = -1;
-    SocketManager listen_socket_manager;
-    SocketManager client_socket_manager;
+    SocketManager listen_socket_manager = {0};
     int exit_code = 0;
+    main_loop.epoll_fd = -1;
+    main_loop.task_queue.event_fd = -1;
 
-    // Check if the port number is provided
-    if (argc != 2)
+    // Check if the port number or the configuration file is provided
+    init_default_config(&server_config);
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
     {
-        printf("Usage: %s <port>\n", argv[0]);
-        exit_code = 1;
-        goto cleanup;
+        config_path = argv[2];
+        if (load_config(config_path, &server_config) == -1)
+        {
+            printf("Failed to load the configuration file: %s\n", config_path);
+            exit_code = 1;
+            goto cleanup;
+        }
+        if (server_config.port_count == 0)
+        {
+            printf("No port in the configuration file: %s\n", config_path);
+            exit_code = 1;
+            goto cleanup;
+        }
     }
-
-    // Parse the port number
-    if (parse_port(argv[1]) == -1)
+    else if (argc == 2)
+    {
+        // Parse the port number
+        if ((server_config.ports[0] = parse_port(argv[1])) == -1)
+        {
+            printf("Invalid port number: %s\n", argv[1]);
+            exit_code = 1;
+            goto cleanup;
+        }
+        server_config.port_count = 1;
+    }
+    else
     {
-        printf("Invalid port number: %s\n", argv[1]);
+        printf("Usage: %s <port> | -c <config_file>\n", argv[0]);
         exit_code = 1;
         goto cleanup;
     }
+    log_level = server_config.log_level;
 
     // Create listen sockets
-    init_socket_manager(&listen_socket_manager, MAX_LISTENS);
-    if (create_listen_sockets(argv[1], &listen_socket_manager) == -1)
+    if (init_socket_manager(&listen_socket_manager, MAX_LISTENS, 0) == -1)
     {
-        puts("Failed to create listen sockets\n");
+        puts("Failed to allocate the listen socket manager\n");
         exit_code = 1;
         goto cleanup;
     }
+    for (int i = 0; i < server_config.port_count; i++)
+    {
+        char port_str[6];
+        snprintf(port_str, sizeof(port_str), "%d", server_config.ports[i]);
+        if (create_listen_sockets(port_str, server_config.port_profiles[i], server_config.reuse_port, &listen_socket_manager) == -1)
+        {
+            puts("Failed to create listen sockets\n");
+            exit_code = 1;
+            goto cleanup;
+        }
 
-    printf("Listening on port %s\n", argv[1]);
+        printf("Listening on port %s (%s profile)\n", port_str, socket_profile_name(server_config.port_profiles[i]));
+    }
 
-    // Create an epoll instance
-    if ((epoll_fd = epoll_create1(0)) == -1)
+    // Create the main event loop, it serves the clients itself unless there are workers
+    if (init_event_loop(&main_loop, 0, &server_config, server_config.workers == 0 ? server_config.max_clients : -1) == -1)
     {
-        perror("server: epoll_create1()");
+        puts("Failed to create the event loop\n");
         exit_code = 1;
         goto cleanup;
     }
 
     // Add the listen sockets to the epoll instance
-    if (add_listen_sockets_to_epoll(epoll_fd, &listen_socket_manager) == -1)
+    if (add_listen_sockets_to_epoll(main_loop.epoll_fd, &listen_socket_manager) == -1)
     {
         puts("Failed to add listen sockets to epoll\n");
         exit_code = 1;
         goto cleanup;
     }
 
-    // Create a pipe for signal handling
-    if (pipe(pipe_fds) == -1)
+    // Add a signalfd to the epoll instance for signal handling
+    if (add_signalfd_to_epoll(main_loop.epoll_fd) == -1)
     {
-        perror("server: pipe()");
+        puts("Failed to add signalfd to epoll\n");
         exit_code = 1;
         goto cleanup;
     }
 
-    // Add the pipe to the epoll instance
-    if (add_pipe_to_epoll(epoll_fd) == -1)
+    if (init_admission_table(&admission_table, server_config.max_connections_per_ip, server_config.accept_rate, server_config.accept_burst) == -1)
     {
-        puts("Failed to add pipe to epoll\n");
+        puts("Failed to allocate the admission table\n");
         exit_code = 1;
         goto cleanup;
     }
 
-    puts("Monitoring for events...");
-
-    struct epoll_event events[MAX_EVENTS];
-    init_socket_manager(&client_socket_manager, MAX_CLIENTS);
-    while (1)
+    // Start the workers after the signals are blocked so that they inherit the mask
+    if (start_workers(&server_config) == -1)
     {
-        // Wait for events indefinitely
-        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-        if (nfds == -1)
-        {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            perror("server: epoll_wait()");
-            exit_code = 1;
-            goto cleanup;
-        }
-
-        for (int i = 0; i < nfds; i++)
-        {
-            SocketData *socket_data;
-            // Check if the event is for the listen socket
-            if ((socket_data = find_socket(&listen_socket_manager, events[i].data.fd)) != NULL)
-            {
-                if ((handle_new_connection(socket_data->socket_fd, epoll_fd, &client_socket_manager)) == -1)
-                {
-                    exit_code = 1;
-                    goto cleanup;
-                }
-            }
-            // Check if the event is for a client socket
-            else if ((socket_data = find_socket(&client_socket_manager, events[i].data.fd)) != NULL)
-            {
-                if (handle_client(socket_data, events[i]) <= 0)
-                {
-                    // The server itself does not exit even if the processing with the client ends abnormally.
-                    close_with_retry(socket_data->socket_fd);
-                    remove_socket(&client_socket_manager, socket_data->socket_fd);
-                }
-            }
-            // Check if the event is for the pipe
-            else if (events[i].data.fd == pipe_fds[0])
-            {
-                int sig;
-                while (read(pipe_fds[0], &sig, sizeof(sig)) == -1)
-                {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-                    {
-                        continue;
-                    }
-                    perror("server: read()");
-                    exit_code = 1;
-                    goto cleanup;
-                }
-
-                if (sig == SIGINT)
-                {
-                    puts("Received SIGINT, exiting...");
-                    goto cleanup;
-                }
-            }
-        }
+        puts("Failed to start the workers\n");
+        exit_code = 1;
+        goto cleanup;
     }
 
+    puts("Monitoring for events...");
+    exit_code = run_event_loop(&main_loop, &listen_socket_manager);
+
 cleanup:
-    if (epoll_fd != -1)
+    stop_workers();
+    free_event_loop(&main_loop);
+    close_all_sockets(&listen_socket_manager);
+    free_admission_table(&admission_table);
+    if (signal_fd != -1)
     {
-        close_with_retry(epoll_fd);
+        close_with_retry(signal_fd);
     }
-    close_all_sockets(&client_socket_manager);
-    close_all_sockets(&listen_socket_manager);
-    close_with_retry(pipe_fds[0]);
-    close_with_retry(pipe_fds[1]);
 
     if (exit_code != 0)
     {
@@ -181,18 +246,21 @@ cleanup:
  * @brief Create and bind listening sockets for the server.
  *
  * This function creates and binds listening sockets for both IPv4 and IPv6, sets the sockets
- * to reuse the address, and adds them to the provided socket manager.
+ * to reuse the address, applies the socket profile, and adds them to the provided socket manager.
  *
  * @param[in] port_str The port number as a string.
+ * @param[in] profile The SOCKET_PROFILE_* of the listening sockets.
+ * @param[in] reuse_port Whether other sockets may listen on the same port and share its connections.
  * @param[in] listen_socket_manager The socket manager for listening sockets.
  * @return The status of the socket creation and binding process.
  * @retval 0 The sockets were successfully created and bound.
  * @retval -1 An error occurred during the process.
  */
-int create_listen_sockets(const char *port_str, SocketManager *listen_socket_manager)
+int create_listen_sockets(const char *port_str, int profile, bool reuse_port, SocketManager *listen_socket_manager)
 {
     struct addrinfo hints, *res, *res0;
     int yes = 1;
+    int count = listen_socket_manager->count;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = PF_UNSPEC; // Allow IPv4 or IPv6
@@ -223,6 +291,14 @@ int create_listen_sockets(const char *port_str, SocketManager *listen_socket_man
             continue;
         }
 
+        // The kernel spreads the connections of a port over every socket listening on it
+        if (reuse_port && setsockopt(listen_socket_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+        {
+            perror("server: setsockopt(SOL_SOCKET, SO_REUSEPORT)");
+            close_with_retry(listen_socket_fd);
+            continue;
+        }
+
         if (res->ai_family == PF_INET6)
         {
             // Set the socket option to allow only IPv6 connections
@@ -234,6 +310,8 @@ int create_listen_sockets(const char *port_str, SocketManager *listen_socket_man
             };
         }
 
+        apply_listen_socket_profile(listen_socket_fd, profile);
+
         if (bind(listen_socket_fd, res->ai_addr, res->ai_addrlen) == -1)
         {
             perror("server: bind()");
@@ -241,19 +319,29 @@ int create_listen_sockets(const char *port_str, SocketManager *listen_socket_man
             continue;
         }
 
-        if (listen(listen_socket_fd, 5) == -1)
+        if (listen(listen_socket_fd, socket_profiles[profile].listen_backlog) == -1)
         {
             perror("server: listen()");
             close_with_retry(listen_socket_fd);
+            freeaddrinfo(res0);
             return -1;
         }
 
-        add_socket(listen_socket_manager, listen_socket_fd);
+        int index;
+        if ((index = add_socket(listen_socket_manager, listen_socket_fd)) == -1)
+        {
+            puts("server: no more room for listen sockets\n");
+            close_with_retry(listen_socket_fd);
+            break;
+        }
+        SocketData *listen_socket_data = get_socket(listen_socket_manager, index);
+        memcpy(&listen_socket_data->cold->addr, res->ai_addr, res->ai_addrlen);
+        listen_socket_data->cold->addr_len = res->ai_addrlen;
     }
 
     freeaddrinfo(res0);
 
-    if (listen_socket_manager->top == listen_socket_manager->max_size - 1)
+    if (listen_socket_manager->count == count)
     {
         puts("server: failed to bind any sockets\n");
         return -1;
@@ -266,6 +354,7 @@ int create_listen_sockets(const char *port_str, SocketManager *listen_socket_man
  * @brief Add the listening sockets to the epoll instance.
  *
  * This function sets the listening sockets to non-blocking mode and adds them to the epoll instance.
+ * Sockets that are already in the epoll instance are skipped.
  *
  * @param[in] epoll_fd The file descriptor of the epoll instance.
  * @param[in] listen_socket_manager The socket manager for listening sockets.
@@ -276,10 +365,11 @@ int create_listen_sockets(const char *port_str, SocketManager *listen_socket_man
 int add_listen_sockets_to_epoll(int epoll_fd, SocketManager *listen_socket_manager)
 {
     struct epoll_event event;
-    for (int i = 0; i < listen_socket_manager->max_size; i++)
+    for (int i = 0; i < listen_socket_manager->size; i++)
     {
-        int listen_socket_fd = listen_socket_manager->sockets[i].socket_fd;
-        if (listen_socket_fd == -1)
+        SocketData *listen_socket_data = get_socket(listen_socket_manager, i);
+        int listen_socket_fd = listen_socket_data->socket_fd;
+        if (listen_socket_fd == -1 || (listen_socket_data->flags & SOCKET_FLAG_EPOLLIN))
         {
             continue;
         }
@@ -315,62 +405,121 @@ int add_listen_sockets_to_epoll(int epoll_fd, SocketManager *listen_socket_manag
             perror("server: epoll_ctl()");
             return -1;
         }
+        listen_socket_data->flags |= SOCKET_FLAG_EPOLLIN;
     }
 
     return 0;
 }
 
 /**
- * @brief Add the pipe to the epoll instance.
+ * @brief Bring the listening sockets in line with the configured ports.
  *
- * This function sets the pipe read end to non-blocking mode and adds it to the epoll instance.
+ * This function closes the listening sockets whose port is no longer configured and creates
+ * listening sockets for newly configured ports, adding them to the epoll instance. A port whose
+ * socket profile changed is reopened, dropping the connections that were not accepted yet.
  *
  * @param[in] epoll_fd The file descriptor of the epoll instance.
+ * @param[in] listen_socket_manager The socket manager for listening sockets.
+ * @param[in] config The configuration holding the ports to listen on.
  * @return The status of the process.
- * @retval 0 The pipe was successfully added to the epoll instance.
- * @retval -1 An error occurred during the process.
+ * @retval 0 The listening sockets match the configured ports.
+ * @retval -1 Some ports could not be opened, the others were still updated.
  */
-int add_pipe_to_epoll(int epoll_fd)
+int update_listen_sockets(int epoll_fd, SocketManager *listen_socket_manager, const ServerConfig *config)
 {
-    // Get the current flags for
-    int flags;
-    while ((flags = fcntl(pipe_fds[0], F_GETFL, 0)) == -1)
+    int result = 0;
+
+    // Close the listen sockets for ports that were removed or changed profile,
+    // server_config still holds the profiles the current sockets were opened with
+    for (int i = 0; i < listen_socket_manager->size; i++)
     {
-        if (errno == EINTR)
+        SocketData *listen_socket_data = get_socket(listen_socket_manager, i);
+        if (listen_socket_data->socket_fd == -1)
         {
             continue;
         }
-        perror("server: fcntl()");
-        return -1;
+
+        int port = get_socket_port(&listen_socket_data->cold->addr);
+        if (config_port_profile(config, port) == config_port_profile(&server_config, port))
+        {
+            continue;
+        }
+
+        // Closing the socket also removes it from the epoll instance
+        close_with_retry(listen_socket_data->socket_fd);
+        remove_socket(listen_socket_manager, listen_socket_data->socket_fd);
+        printf("Stopped listening on port %d\n", port);
     }
 
-    // Set the pipe read end to non-blocking mode
-    while (fcntl(pipe_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+    // Create listen sockets for ports that were added
+    for (int i = 0; i < config->port_count; i++)
     {
-        if (errno == EINTR)
+        bool listening = false;
+        for (int j = 0; j < listen_socket_manager->size && !listening; j++)
+        {
+            SocketData *listen_socket_data = get_socket(listen_socket_manager, j);
+            listening = listen_socket_data->socket_fd != -1 && get_socket_port(&listen_socket_data->cold->addr) == config->ports[i];
+        }
+        if (listening)
         {
             continue;
         }
-        perror("server: fcntl()");
+
+        char port_str[6];
+        snprintf(port_str, sizeof(port_str), "%d", config->ports[i]);
+        if (create_listen_sockets(port_str, config->port_profiles[i], config->reuse_port, listen_socket_manager) == -1)
+        {
+            printf("Failed to listen on port %s\n", port_str);
+            result = -1;
+            continue;
+        }
+        printf("Listening on port %s (%s profile)\n", port_str, socket_profile_name(config->port_profiles[i]));
+    }
+
+    if (add_listen_sockets_to_epoll(epoll_fd, listen_socket_manager) == -1)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Add a signalfd to the epoll instance.
+ *
+ * This function blocks SIGINT, SIGHUP and SIGUSR1 so that they are no longer delivered
+ * asynchronously, and creates a non-blocking signalfd for them that is added to the epoll
+ * instance. The signals are then handled on the event loop like any other event.
+ *
+ * @param[in] epoll_fd The file descriptor of the epoll instance.
+ * @return The status of the process.
+ * @retval 0 The signalfd was successfully added to the epoll instance.
+ * @retval -1 An error occurred during the process.
+ */
+int add_signalfd_to_epoll(int epoll_fd)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        perror("server: sigprocmask()");
         return -1;
     }
 
-    // Set up a signal handler for SIGINT
-    struct sigaction sa;
-    sa.sa_handler = handle_sigint;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    if (sigaction(SIGINT, &sa, NULL) == -1)
+    if ((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
     {
-        perror("server: sigaction()");
+        perror("server: signalfd()");
         return -1;
     }
 
-    // Add the pipe read end to the epoll instance
+    // Add the signalfd to the epoll instance
     struct epoll_event event;
     event.events = EPOLLIN;
-    event.data.fd = pipe_fds[0];
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fds[0], &event) == -1)
+    event.data.fd = signal_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1)
     {
         perror("server: epoll_ctl()");
         return -1;
@@ -380,186 +529,1158 @@ int add_pipe_to_epoll(int epoll_fd)
 }
 
 /**
- * @brief Handle a new connection on the listening socket.
- *
- * This function accepts a new connection on the listening socket, sets the new connection
- * socket to non-blocking mode, adds it to the epoll instance, and registers it with the
- * client socket manager.
+ * @brief Add the eventfd of a task queue to the epoll instance.
  *
- * @param[in] listen_socket_fd The file descriptor of the listening socket.
  * @param[in] epoll_fd The file descriptor of the epoll instance.
- * @param[in] client_socket_manager The socket manager for client sockets.
- * @return The status of the new connection.
- * @retval 0 The connection was successfully accepted and registered.
+ * @param[in] task_queue The task queue of the event loop.
+ * @return The status of the process.
+ * @retval 0 The eventfd was successfully added to the epoll instance.
  * @retval -1 An error occurred during the process.
  */
-int handle_new_connection(int listen_socket_fd, int epoll_fd, SocketManager *client_socket_manager)
+int add_task_queue_to_epoll(int epoll_fd, TaskQueue *task_queue)
 {
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    int conn_socket_fd;
-
-    if ((conn_socket_fd = accept(listen_socket_fd, (struct sockaddr *)&client_addr, &addr_len)) == -1)
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = task_queue->event_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, task_queue->event_fd, &event) == -1)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-        {
-            return 0;
-        }
-        else
-        {
-            perror("server: accept()");
-            return -1;
-        }
+        perror("server: epoll_ctl()");
+        return -1;
     }
 
-    // Get the current flags for the connection socket
-    int flags;
-    while ((flags = fcntl(conn_socket_fd, F_GETFL, 0)) == -1)
+    return 0;
+}
+
+/**
+ * @brief Initialize an event loop.
+ *
+ * This function creates the epoll instance, the events array, the client socket manager and the
+ * task queue of the loop. The loop must be zeroed before the call, and it can be freed with
+ * free_event_loop() even if the initialization fails.
+ *
+ * @param[in] loop The event loop.
+ * @param[in] id The number of the loop, 0 for the main loop.
+ * @param[in] config The configuration of the loop.
+ * @param[in] max_clients The number of clients the loop may serve, -1 if it serves none.
+ * @return The status of the process.
+ * @retval 0 The loop was successfully initialized.
+ * @retval -1 An error occurred during the process.
+ */
+int init_event_loop(EventLoop *loop, int id, const ServerConfig *config, int max_clients)
+{
+    loop->id = id;
+    loop->epoll_fd = -1;
+    loop->task_queue.event_fd = -1;
+    loop->config = *config;
+    loop->last_idle_check_ms = monotonic_ms();
+    atomic_init(&loop->stopping, false);
+    atomic_init(&loop->connections, 0);
+    atomic_init(&loop->bytes_in_flight, 0);
+    atomic_init(&loop->stats_requested, false);
+
+    // Create an epoll instance
+    if ((loop->epoll_fd = epoll_create1(0)) == -1)
     {
-        if (errno == EINTR)
-        {
-            continue;
-        }
-        perror("server: fcntl(conn_sock)");
-        close_with_retry(conn_socket_fd);
+        perror("server: epoll_create1()");
         return -1;
     }
 
-    // Set the connection socket to non-blocking mode
-    while (fcntl(conn_socket_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    if ((loop->events = (struct epoll_event *)malloc(config->max_events * sizeof(struct epoll_event))) == NULL)
     {
-        if (errno == EINTR)
-        {
-            continue;
-        }
-        perror("server: fcntl(conn_sock)");
-        close_with_retry(conn_socket_fd);
+        perror("server: malloc()");
         return -1;
     }
 
-    // Fulfilled the maximum number of clients
-    if (add_socket(client_socket_manager, conn_socket_fd) == -1)
+    if (max_clients >= 0)
     {
-        puts("No more room for clients\n");
-        close_with_retry(conn_socket_fd);
-        return 0;
+        if (init_socket_manager(&loop->client_socket_manager, max_clients, config->buffer_size) == -1)
+        {
+            puts("Failed to allocate the client socket manager\n");
+            return -1;
+        }
+        loop->client_socket_manager.lazy_buffers = config->buffer_mode == BUFFER_MODE_LAZY;
+        if (grow_scratch_buffer(loop, config->buffer_size) == -1)
+        {
+            return -1;
+        }
     }
 
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLOUT;
-    event.data.fd = conn_socket_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_socket_fd, &event) == -1)
+    // Create a task queue so that other threads can hand work to the event loop
+    if (init_task_queue(&loop->task_queue) == -1 || add_task_queue_to_epoll(loop->epoll_fd, &loop->task_queue) == -1)
     {
-        perror("server: epoll_ctl()");
-        close_with_retry(conn_socket_fd);
+        puts("Failed to add task queue to epoll\n");
         return -1;
     }
 
-    char client_ip[INET6_ADDRSTRLEN];
-    if (client_addr.ss_family == PF_INET)
+    return 0;
+}
+
+void free_event_loop(EventLoop *loop)
+{
+    if (loop->epoll_fd != -1)
     {
-        struct sockaddr_in *client_addr4 = (struct sockaddr_in *)&client_addr;
-        if (inet_ntop(PF_INET, &client_addr4->sin_addr, client_ip, sizeof(client_ip)) == NULL)
-        {
-            perror("server: inet_ntop(PF_INET)");
-            return -1;
-        }
-        printf("Connection from %s, %d\n", client_ip, ntohs(client_addr4->sin_port));
+        close_with_retry(loop->epoll_fd);
+        loop->epoll_fd = -1;
     }
-    else if (client_addr.ss_family == PF_INET6)
+    // The admission table goes away with the server, so the records of counted clients are only freed
+    for (int i = 0; i < loop->client_socket_manager.size; i++)
     {
-        struct sockaddr_in6 *client_addr6 = (struct sockaddr_in6 *)&client_addr;
-        if (inet_ntop(PF_INET6, &client_addr6->sin6_addr, client_ip, sizeof(client_ip)) == NULL)
+        SocketData *client_socket_data = get_socket(&loop->client_socket_manager, i);
+        if (client_socket_data->socket_fd != -1)
         {
-            perror("server: inet_ntop(PF_INET6)");
-            return -1;
+            free(client_socket_data->cold->admission_record);
         }
-        printf("Connection from %s, %d\n", client_ip, ntohs(client_addr6->sin6_port));
     }
+    close_all_sockets(&loop->client_socket_manager);
+    free_task_queue(&loop->task_queue);
+    free(loop->events);
+    loop->events = NULL;
+    free(loop->scratch_buffer);
+    loop->scratch_buffer = NULL;
+}
 
+/**
+ * @brief Make the scratch buffer of an event loop large enough for a buffer size.
+ *
+ * The scratch buffer never shrinks, since clients accepted under a larger buffer size may still
+ * read into it.
+ *
+ * @param[in] loop The event loop.
+ * @param[in] buffer_size The buffer size of new clients.
+ * @return The status of the process.
+ * @retval 0 The scratch buffer is large enough.
+ * @retval -1 The scratch buffer could not be grown.
+ */
+int grow_scratch_buffer(EventLoop *loop, unsigned int buffer_size)
+{
+    if (buffer_size <= loop->scratch_size)
+    {
+        return 0;
+    }
+    char *scratch_buffer;
+    if ((scratch_buffer = (char *)realloc(loop->scratch_buffer, buffer_size)) == NULL)
+    {
+        perror("server: realloc()");
+        return -1;
+    }
+    loop->scratch_buffer = scratch_buffer;
+    loop->scratch_size = buffer_size;
     return 0;
 }
 
 /**
- * @brief Handle the client socket
+ * @brief Run an event loop until it is stopped.
  *
- * This function handles communication with a connected client socket. It reads data from the client,
- * processes it, and sends a response back to the client. The function continues to read and send data
- * until the client disconnects or an error occurs.
+ * The main loop is given the listening sockets and also handles signals. Worker loops only serve
+ * their clients and run the tasks handed to them.
  *
- * @param[in] client_socket_data The socket data for the client socket.
- * @param[in] event The epoll event for the client socket.
- * @return The status of the client connection.
- * @retval 1 The client is still connected.
- * @retval 0 The client has disconnected.
- * @retval -1 An error occurred during communication.
+ * @param[in] loop The event loop.
+ * @param[in] listen_socket_manager The socket manager for listening sockets, NULL for workers.
+ * @return The exit code of the loop.
+ * @retval 0 The loop was stopped normally.
+ * @retval 1 An error occurred.
  */
-int handle_client(SocketData *client_socket_data, struct epoll_event event)
+int run_event_loop(EventLoop *loop, SocketManager *listen_socket_manager)
 {
-    // Check if the client socket is ready to read
-    if (event.events & EPOLLIN)
+    while (!atomic_load_explicit(&loop->stopping, memory_order_relaxed))
     {
-        ssize_t received_bytes;
-        if ((received_bytes = recv(client_socket_data->socket_fd, client_socket_data->buffer, BUFFER_SIZE - 1, 0)) > 0)
-        {
-            printf("received_bytes: %ld (fd: %d)\n", received_bytes, client_socket_data->socket_fd);
-            client_socket_data->buffer[received_bytes] = '\0'; // Null-terminate the string
-        }
-        else if (received_bytes == 0)
+        // Wait for events indefinitely, unless throttled or idle clients have to be checked later
+        int timeout = -1;
+        if (loop->config.idle_timeout > 0)
         {
-            puts("Connection closed\n");
-            return 0;
+            timeout = IDLE_CHECK_MS;
         }
-        else
+        if (loop->closing_clients > 0)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-            {
-                return 1;
-            }
-            perror("server: recv()");
-            return -1;
+            timeout = CLOSING_CHECK_MS;
         }
-    }
-
-    // Check if the client socket is ready to write
-    if (event.events & EPOLLOUT)
-    {
-        ssize_t sent_bytes;
-        if ((sent_bytes = send(client_socket_data->socket_fd, client_socket_data->buffer, strlen(client_socket_data->buffer), 0)) >= 0)
+        if (loop->has_throttled_clients)
         {
-            memmove(client_socket_data->buffer, client_socket_data->buffer + sent_bytes, strlen(client_socket_data->buffer) - sent_bytes);
-            client_socket_data->buffer[strlen(client_socket_data->buffer) - sent_bytes] = '\0';
+            // Resume before a bucket is full, the tokens it would gain afterwards are lost
+            long long resume_in_ms = loop->next_resume_ms - monotonic_ms();
+            timeout = resume_in_ms <= 0 ? 0 : resume_in_ms < THROTTLE_CHECK_MS ? (int)resume_in_ms : THROTTLE_CHECK_MS;
         }
-        else
+        int nfds = epoll_wait(loop->epoll_fd, loop->events, loop->config.max_events, timeout);
+        if (nfds == -1)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            if (errno == EINTR)
             {
-                return 1;
+                continue;
             }
-            perror("server: send()");
-            return -1;
+            perror("server: epoll_wait()");
+            return 1;
         }
-    }
 
-    return 1;
-}
-
-/**
- * @brief Handle the SIGINT signal
- *
- * This function writes the signal number to the pipe to notify the main loop to exit.
- *
- * @param[in] sig The signal number.
- */
-void handle_sigint(int sig)
-{
-    while (write(pipe_fds[1], &sig, sizeof(sig)) == -1)
-    {
-        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        struct epoll_event *events = loop->events;
+        for (int i = 0; i < nfds; i++)
         {
-            continue;
+            SocketData *socket_data;
+            // Check if the event is for the listen socket
+            if (listen_socket_manager != NULL && (socket_data = find_socket(listen_socket_manager, events[i].data.fd)) != NULL)
+            {
+                int profile = config_port_profile(&server_config, get_socket_port(&socket_data->cold->addr));
+                if (handle_new_connection(socket_data->socket_fd, profile) == -1)
+                {
+                    return 1;
+                }
+            }
+            // Check if the event is for a client socket
+            else if ((socket_data = find_socket(&loop->client_socket_manager, events[i].data.fd)) != NULL &&
+                     (socket_data->flags & SOCKET_FLAG_CLOSING))
+            {
+                handle_closing_client(loop, socket_data);
+            }
+            else if (socket_data != NULL)
+            {
+                unsigned int pending_len = socket_data->pending_len;
+                char *scratch_buffer = loop->config.buffer_mode == BUFFER_MODE_LAZY ? loop->scratch_buffer : NULL;
+                int status = handle_client(socket_data, events[i].events, &loop->config, &socket_transport, scratch_buffer, monotonic_ms());
+                loop->pending_bytes = loop->pending_bytes - pending_len + socket_data->pending_len;
+                if (status <= 0 || update_client_events(loop->epoll_fd, socket_data) == -1)
+                {
+                    // The server itself does not exit even if the processing with the client ends abnormally.
+                    close_client(loop, socket_data);
+                }
+                else if (socket_data->flags & SOCKET_FLAG_THROTTLED)
+                {
+                    long long full_at_ms = token_bucket_full_at_ms(&socket_data->cold->byte_bucket, loop->config.bytes_rate, loop->config.bytes_burst);
+                    if (!loop->has_throttled_clients || full_at_ms < loop->next_resume_ms)
+                    {
+                        loop->next_resume_ms = full_at_ms;
+                    }
+                    loop->has_throttled_clients = true;
+                }
+            }
+            // Check if the event is for the task queue
+            else if (events[i].data.fd == loop->task_queue.event_fd)
+            {
+                if (run_tasks(&loop->task_queue) == -1)
+                {
+                    return 1;
+                }
+                // A task may have stopped the loop or reallocated the events array
+                if (atomic_load_explicit(&loop->stopping, memory_order_relaxed) || loop->events != events)
+                {
+                    break;
+                }
+            }
+            // Check if the event is for the signalfd
+            else if (listen_socket_manager != NULL && events[i].data.fd == signal_fd)
+            {
+                struct signalfd_siginfo siginfo;
+                ssize_t read_bytes;
+                while ((read_bytes = read(signal_fd, &siginfo, sizeof(siginfo))) == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (read_bytes != sizeof(siginfo))
+                {
+                    if (read_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    {
+                        continue;
+                    }
+                    perror("server: read()");
+                    return 1;
+                }
+
+                if (siginfo.ssi_signo == SIGINT)
+                {
+                    puts("Received SIGINT, exiting...");
+                    return 0;
+                }
+                else if (siginfo.ssi_signo == SIGHUP)
+                {
+                    // The events array may be reallocated, so stop processing this batch
+                    reload_config(listen_socket_manager);
+                    break;
+                }
+                else if (siginfo.ssi_signo == SIGUSR1)
+                {
+                    request_stats();
+                }
+            }
+        }
+
+        // Publish the load of the loop for the acceptor
+        atomic_store_explicit(&loop->bytes_in_flight, loop->pending_bytes, memory_order_relaxed);
+
+        if (loop->has_throttled_clients)
+        {
+            loop->has_throttled_clients = resume_throttled_clients(loop) > 0;
+        }
+        if (loop->closing_clients > 0)
+        {
+            close_lingering_clients(loop);
+        }
+        if (loop->config.idle_timeout > 0 && monotonic_ms() - loop->last_idle_check_ms >= IDLE_CHECK_MS)
+        {
+            close_idle_clients(loop);
+            loop->last_idle_check_ms = monotonic_ms();
+        }
+    }
+
+    return 0;
+}
+
+void *run_worker(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+    if (run_event_loop(loop, NULL) != 0)
+    {
+        printf("Worker %d stopped on an error\n", loop->id);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the worker threads.
+ *
+ * Each worker runs its own event loop with its own client socket manager and epoll instance.
+ * Signals must already be blocked, so that the workers inherit the mask and leave them to the
+ * signalfd of the main loop.
+ *
+ * @param[in] config The configuration holding the number of workers.
+ * @return The status of the process.
+ * @retval 0 The workers were successfully started.
+ * @retval -1 An error occurred, the workers started so far are left running for stop_workers().
+ */
+int start_workers(const ServerConfig *config)
+{
+    if (config->workers == 0)
+    {
+        return 0;
+    }
+
+    // Workers are cache-line aligned so that the load counters read by the acceptor do not share lines
+    if ((workers = (EventLoop *)aligned_alloc(CACHE_LINE_SIZE, config->workers * sizeof(EventLoop))) == NULL)
+    {
+        perror("server: aligned_alloc()");
+        return -1;
+    }
+    memset(workers, 0, config->workers * sizeof(EventLoop));
+
+    for (int i = 0; i < config->workers; i++)
+    {
+        if (init_event_loop(&workers[i], i + 1, config, worker_max_clients(config, i)) == -1)
+        {
+            free_event_loop(&workers[i]);
+            return -1;
+        }
+
+        int pthread_result;
+        if ((pthread_result = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) != 0)
+        {
+            printf("server: pthread_create(): %s\n", strerror(pthread_result));
+            free_event_loop(&workers[i]);
+            return -1;
+        }
+        worker_count++;
+    }
+
+    printf("Started %d workers\n", worker_count);
+    return 0;
+}
+
+/**
+ * @brief Stop the worker threads and free their event loops.
+ *
+ * Clients served by the workers are closed.
+ */
+void stop_workers(void)
+{
+    for (int i = 0; i < worker_count; i++)
+    {
+        atomic_store(&workers[i].stopping, true);
+        wake_task_queue(&workers[i].task_queue);
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free_event_loop(&workers[i]);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+/**
+ * @brief Handle a new connection on the listening socket.
+ *
+ * This function accepts a new connection on the listening socket, checks the peer against the
+ * admission table and sets the new connection socket to non-blocking mode. The connection is
+ * then registered with the main event loop, or handed over to the least loaded worker.
+ *
+ * @param[in] listen_socket_fd The file descriptor of the listening socket.
+ * @param[in] profile The SOCKET_PROFILE_* of the listening socket.
+ * @return The status of the new connection.
+ * @retval 0 The connection was successfully accepted and registered.
+ * @retval -1 An error occurred during the process.
+ */
+int handle_new_connection(int listen_socket_fd, int profile)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    int conn_socket_fd;
+
+    if ((conn_socket_fd = accept(listen_socket_fd, (struct sockaddr *)&client_addr, &addr_len)) == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
+        else
+        {
+            perror("server: accept()");
+            return -1;
+        }
+    }
+
+    // Refuse peers over their connection or accept rate limit before spending anything on them
+    long long now_ms = monotonic_ms();
+    int admission;
+    if ((admission = admission_acquire(&admission_table, &client_addr, now_ms)) == -1)
+    {
+        log_printf(LOG_LEVEL_DEBUG, "Refused connection (fd: %d)\n", conn_socket_fd);
+        close_with_retry(conn_socket_fd);
+        return 0;
+    }
+
+    // Get the current flags for the connection socket
+    int flags;
+    while ((flags = fcntl(conn_socket_fd, F_GETFL, 0)) == -1)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        perror("server: fcntl(conn_sock)");
+        if (admission == 1)
+        {
+            admission_release(&admission_table, &client_addr);
+        }
+        close_with_retry(conn_socket_fd);
+        return -1;
+    }
+
+    // Set the connection socket to non-blocking mode
+    while (fcntl(conn_socket_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        perror("server: fcntl(conn_sock)");
+        if (admission == 1)
+        {
+            admission_release(&admission_table, &client_addr);
+        }
+        close_with_retry(conn_socket_fd);
+        return -1;
+    }
+
+    if (worker_count == 0)
+    {
+        atomic_fetch_add_explicit(&main_loop.connections, 1, memory_order_relaxed);
+        return register_client(&main_loop, conn_socket_fd, &client_addr, addr_len, profile, admission == 1, NULL);
+    }
+
+    // Hand the connection over to the least loaded worker that still has room
+    EventLoop *loop = pick_worker();
+    if (loop == NULL)
+    {
+        puts("No more room for clients\n");
+        if (admission == 1)
+        {
+            admission_release(&admission_table, &client_addr);
+        }
+        close_with_retry(conn_socket_fd);
+        return 0;
+    }
+
+    NewConnection *new_connection;
+    if ((new_connection = (NewConnection *)malloc(sizeof(NewConnection))) == NULL)
+    {
+        perror("server: malloc()");
+        if (admission == 1)
+        {
+            admission_release(&admission_table, &client_addr);
+        }
+        close_with_retry(conn_socket_fd);
+        return 0;
+    }
+    new_connection->loop = loop;
+    new_connection->socket_fd = conn_socket_fd;
+    memcpy(&new_connection->addr, &client_addr, addr_len);
+    new_connection->addr_len = addr_len;
+    new_connection->profile = profile;
+    new_connection->admitted = admission == 1;
+
+    // Count the connection right away so that a burst of accepts is spread over the workers
+    atomic_fetch_add_explicit(&new_connection->loop->connections, 1, memory_order_relaxed);
+    submit_task(&new_connection->loop->task_queue, &new_connection->task, register_client_task, discard_new_connection, new_connection);
+
+    return 0;
+}
+
+/**
+ * @brief Register an accepted connection with an event loop.
+ *
+ * This function adds the connection socket to the client socket manager and to the epoll instance
+ * of the loop. It must run on the thread of the loop.
+ *
+ * @param[in] loop The event loop that is going to serve the client.
+ * @param[in] conn_socket_fd The file descriptor of the connection socket.
+ * @param[in] client_addr The peer address returned by accept().
+ * @param[in] addr_len The length of the peer address.
+ * @param[in] profile The SOCKET_PROFILE_* of the listening socket that accepted the connection.
+ * @param[in] admitted Whether the connection is counted in the admission table.
+ * @param[in] record The NewConnection a counted connection was handed over with, kept to release
+ * it without allocating on close. NULL on the main loop.
+ * @return The status of the registration.
+ * @retval 0 The connection was registered, or closed because the loop is full.
+ * @retval -1 An error occurred during the process.
+ */
+int register_client(EventLoop *loop, int conn_socket_fd, const struct sockaddr_storage *client_addr, socklen_t addr_len, int profile, bool admitted, NewConnection *record)
+{
+    // Fulfilled the maximum number of clients
+    int index;
+    if ((index = add_socket(&loop->client_socket_manager, conn_socket_fd)) == -1)
+    {
+        puts("No more room for clients\n");
+        if (admitted)
+        {
+            release_admission(loop, client_addr, record);
+        }
+        close_with_retry(conn_socket_fd);
+        atomic_fetch_sub_explicit(&loop->connections, 1, memory_order_relaxed);
+        return 0;
+    }
+    long long now_ms = monotonic_ms();
+    SocketData *client_socket_data = get_socket(&loop->client_socket_manager, index);
+    memcpy(&client_socket_data->cold->addr, client_addr, addr_len);
+    client_socket_data->cold->addr_len = addr_len;
+    client_socket_data->cold->last_active_ms = now_ms;
+    token_bucket_init(&client_socket_data->cold->byte_bucket, loop->config.bytes_burst, now_ms);
+    if (admitted)
+    {
+        client_socket_data->flags |= SOCKET_FLAG_ADMITTED;
+        client_socket_data->cold->admission_record = record;
+    }
+
+    // Only wait for input, EPOLLOUT is added while there is data waiting to be sent
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = conn_socket_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn_socket_fd, &event) == -1)
+    {
+        perror("server: epoll_ctl()");
+        close_client(loop, client_socket_data);
+        return -1;
+    }
+    client_socket_data->flags |= SOCKET_FLAG_EPOLLIN;
+
+    apply_client_socket_profile(conn_socket_fd, profile);
+
+    // Allow large echoes to be sent without copying them into the kernel
+    if (loop->config.zerocopy_threshold > 0)
+    {
+        int yes = 1;
+        if (setsockopt(conn_socket_fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(int)) == -1)
+        {
+            log_printf(LOG_LEVEL_DEBUG, "SO_ZEROCOPY is not available (fd: %d)\n", conn_socket_fd);
+        }
+        else
+        {
+            client_socket_data->flags |= SOCKET_FLAG_ZEROCOPY;
+        }
+    }
+
+    char client_ip[INET6_ADDRSTRLEN];
+    if (client_addr->ss_family == PF_INET)
+    {
+        const struct sockaddr_in *client_addr4 = (const struct sockaddr_in *)client_addr;
+        if (inet_ntop(PF_INET, &client_addr4->sin_addr, client_ip, sizeof(client_ip)) == NULL)
+        {
+            perror("server: inet_ntop(PF_INET)");
+            return -1;
+        }
+        log_printf(LOG_LEVEL_INFO, "Connection from %s, %d\n", client_ip, ntohs(client_addr4->sin_port));
+    }
+    else if (client_addr->ss_family == PF_INET6)
+    {
+        const struct sockaddr_in6 *client_addr6 = (const struct sockaddr_in6 *)client_addr;
+        if (inet_ntop(PF_INET6, &client_addr6->sin6_addr, client_ip, sizeof(client_ip)) == NULL)
+        {
+            perror("server: inet_ntop(PF_INET6)");
+            return -1;
+        }
+        log_printf(LOG_LEVEL_INFO, "Connection from %s, %d\n", client_ip, ntohs(client_addr6->sin6_port));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Register a connection handed over by the acceptor, on the thread of the worker.
+ *
+ * @param[in] arg The NewConnection describing the connection. It is freed by this function unless
+ * the connection is counted in the admission table, then it goes back to the acceptor on close.
+ */
+void register_client_task(void *arg)
+{
+    NewConnection *new_connection = (NewConnection *)arg;
+    bool admitted = new_connection->admitted;
+    register_client(new_connection->loop, new_connection->socket_fd, &new_connection->addr, new_connection->addr_len, new_connection->profile,
+                    admitted, admitted ? new_connection : NULL);
+    if (!admitted)
+    {
+        free(new_connection);
+    }
+}
+
+/**
+ * @brief Close a connection handed over to a worker that stopped before registering it.
+ *
+ * Runs on the main thread after the worker was joined, so the admission table can be updated
+ * directly.
+ *
+ * @param[in] arg The NewConnection describing the connection, freed by this function.
+ */
+void discard_new_connection(void *arg)
+{
+    NewConnection *new_connection = (NewConnection *)arg;
+    atomic_fetch_sub_explicit(&new_connection->loop->connections, 1, memory_order_relaxed);
+    if (new_connection->admitted)
+    {
+        admission_release(&admission_table, &new_connection->addr);
+    }
+    close_with_retry(new_connection->socket_fd);
+    free(new_connection);
+}
+
+/**
+ * @brief Pick the worker that should serve the next connection.
+ *
+ * Workers that already reached their share of max_clients are skipped, so a connection is never
+ * handed to a worker that would only close it.
+ *
+ * @return The worker with the fewest connections or bytes in flight, depending on the
+ * configuration, or NULL if every worker is full.
+ */
+EventLoop *pick_worker(void)
+{
+    EventLoop *best = NULL;
+    unsigned long long best_connections = 0;
+    unsigned long long best_bytes = 0;
+    for (int i = 0; i < worker_count; i++)
+    {
+        unsigned long long connections = atomic_load_explicit(&workers[i].connections, memory_order_relaxed);
+        unsigned long long bytes = atomic_load_explicit(&workers[i].bytes_in_flight, memory_order_relaxed);
+        if (connections >= (unsigned long long)worker_max_clients(&server_config, i))
+        {
+            continue;
+        }
+        bool better;
+        if (server_config.balance == BALANCE_BYTES)
+        {
+            better = bytes < best_bytes || (bytes == best_bytes && connections < best_connections);
+        }
+        else
+        {
+            better = connections < best_connections || (connections == best_connections && bytes < best_bytes);
+        }
+        if (best == NULL || better)
+        {
+            best = &workers[i];
+            best_connections = connections;
+            best_bytes = bytes;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Give back the connection slot of a counted peer in the admission table.
+ *
+ * The admission table belongs to the main thread, so workers send the NewConnection the client
+ * arrived with back to it. Nothing is allocated, so the release cannot be lost.
+ *
+ * @param[in] loop The event loop that served the client.
+ * @param[in] addr The peer address of the client.
+ * @param[in] record The NewConnection of the client on a worker, NULL on the main loop.
+ */
+void release_admission(EventLoop *loop, const struct sockaddr_storage *addr, NewConnection *record)
+{
+    if (loop == &main_loop)
+    {
+        admission_release(&admission_table, addr);
+        return;
+    }
+    submit_task(&main_loop.task_queue, &record->task, release_admission_task, free, record);
+}
+
+void release_admission_task(void *arg)
+{
+    NewConnection *record = (NewConnection *)arg;
+    admission_release(&admission_table, &record->addr);
+    free(record);
+}
+
+/**
+ * @brief Update the epoll events of a client socket to match its state.
+ *
+ * This function registers the client socket for the events returned by get_client_events().
+ *
+ * @param[in] epoll_fd The file descriptor of the epoll instance.
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @return The status of the process.
+ * @retval 0 The events were successfully updated.
+ * @retval -1 An error occurred during the process.
+ */
+int update_client_events(int epoll_fd, SocketData *client_socket_data)
+{
+    unsigned int flags = get_client_events(client_socket_data);
+    if (flags == (client_socket_data->flags & (SOCKET_FLAG_EPOLLIN | SOCKET_FLAG_EPOLLOUT)))
+    {
+        return 0;
+    }
+
+    struct epoll_event event;
+    event.events = ((flags & SOCKET_FLAG_EPOLLIN) ? EPOLLIN : 0) | ((flags & SOCKET_FLAG_EPOLLOUT) ? EPOLLOUT : 0);
+    event.data.fd = client_socket_data->socket_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_socket_data->socket_fd, &event) == -1)
+    {
+        perror("server: epoll_ctl()");
+        return -1;
+    }
+    client_socket_data->flags = (client_socket_data->flags & ~(SOCKET_FLAG_EPOLLIN | SOCKET_FLAG_EPOLLOUT)) | flags;
+    return 0;
+}
+
+/**
+ * @brief Resume reading from throttled clients whose byte bucket has refilled.
+ *
+ * The next check is scheduled for when the first bucket of the clients still throttled is full,
+ * so no client loses tokens while it waits and each one gets its whole byte rate.
+ *
+ * @param[in] loop The event loop.
+ * @return The number of clients that are still throttled.
+ */
+int resume_throttled_clients(EventLoop *loop)
+{
+    int throttled = 0;
+    long long now_ms = monotonic_ms();
+    for (int i = 0; i < loop->client_socket_manager.size; i++)
+    {
+        SocketData *client_socket_data = get_socket(&loop->client_socket_manager, i);
+        if (client_socket_data->socket_fd == -1 || !(client_socket_data->flags & SOCKET_FLAG_THROTTLED))
+        {
+            continue;
+        }
+
+        long long full_at_ms;
+        if (resume_client(client_socket_data, &loop->config, now_ms))
+        {
+            full_at_ms = token_bucket_full_at_ms(&client_socket_data->cold->byte_bucket, loop->config.bytes_rate, loop->config.bytes_burst);
+        }
+        else if (update_client_events(loop->epoll_fd, client_socket_data) == -1)
+        {
+            // Leave the client throttled and try again on the next check
+            client_socket_data->flags |= SOCKET_FLAG_THROTTLED;
+            full_at_ms = now_ms + THROTTLE_CHECK_MS;
+        }
+        else
+        {
+            continue;
+        }
+        if (throttled == 0 || full_at_ms < loop->next_resume_ms)
+        {
+            loop->next_resume_ms = full_at_ms;
+        }
+        throttled++;
+    }
+    return throttled;
+}
+
+/**
+ * @brief Close a client socket and forget it.
+ *
+ * A client with zerocopy sends in flight is only shut down for writing. The kernel may still be
+ * transmitting from its buffer, so the socket and buffer are kept until the sends complete.
+ *
+ * @param[in] loop The event loop that serves the client.
+ * @param[in] client_socket_data The socket data for the client socket.
+ */
+void close_client(EventLoop *loop, SocketData *client_socket_data)
+{
+    if ((client_socket_data->flags & (SOCKET_FLAG_ZEROCOPY_PENDING | SOCKET_FLAG_CLOSING)) == SOCKET_FLAG_ZEROCOPY_PENDING &&
+        linger_client(loop, client_socket_data) == 0)
+    {
+        return;
+    }
+
+    int client_socket_fd = client_socket_data->socket_fd;
+    if (client_socket_data->flags & SOCKET_FLAG_CLOSING)
+    {
+        loop->closing_clients--;
+    }
+    else
+    {
+        loop->pending_bytes -= client_socket_data->pending_len;
+    }
+    if (client_socket_data->flags & SOCKET_FLAG_ADMITTED)
+    {
+        release_admission(loop, &client_socket_data->cold->addr, (NewConnection *)client_socket_data->cold->admission_record);
+    }
+    close_with_retry(client_socket_fd);
+    remove_socket(&loop->client_socket_manager, client_socket_fd);
+    atomic_fetch_sub_explicit(&loop->connections, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Start closing a client whose buffer is still pinned by zerocopy sends.
+ *
+ * The bytes already handed to the kernel go out followed by a FIN, as they would after close().
+ * The socket then only waits for the completion notifications, which raise EPOLLERR. Registering
+ * it edge-triggered without events keeps a hung up socket from being reported over and over.
+ *
+ * @param[in] loop The event loop that serves the client.
+ * @param[in] client_socket_data The socket data for the client socket.
+ * @return The status of the process.
+ * @retval 0 The client is closing and will be closed once its sends complete.
+ * @retval -1 The client could not be kept, it has to be closed right away.
+ */
+int linger_client(EventLoop *loop, SocketData *client_socket_data)
+{
+    struct epoll_event event;
+    event.events = EPOLLET;
+    event.data.fd = client_socket_data->socket_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, client_socket_data->socket_fd, &event) == -1)
+    {
+        perror("server: epoll_ctl()");
+        return -1;
+    }
+    if (shutdown(client_socket_data->socket_fd, SHUT_WR) == -1 && errno != ENOTCONN)
+    {
+        perror("server: shutdown()");
+    }
+
+    loop->pending_bytes -= client_socket_data->pending_len;
+    client_socket_data->flags &= ~(SOCKET_FLAG_EPOLLIN | SOCKET_FLAG_EPOLLOUT | SOCKET_FLAG_THROTTLED);
+    client_socket_data->flags |= SOCKET_FLAG_CLOSING;
+    client_socket_data->cold->last_active_ms = monotonic_ms();
+    loop->closing_clients++;
+    log_printf(LOG_LEVEL_DEBUG, "Waiting for %u zerocopy sends before closing (fd: %d)\n",
+               client_socket_data->cold->zerocopy_issued - client_socket_data->cold->zerocopy_completed, client_socket_data->socket_fd);
+    return 0;
+}
+
+/**
+ * @brief Reap the zerocopy completions of a closing client, closing it once none are left.
+ *
+ * Errors on the socket are ignored, a reset connection still releases its sends.
+ *
+ * @param[in] loop The event loop that serves the client.
+ * @param[in] client_socket_data The socket data for the client socket.
+ */
+void handle_closing_client(EventLoop *loop, SocketData *client_socket_data)
+{
+    unsigned int completed = client_socket_data->cold->zerocopy_completed;
+    reap_zerocopy_completions(client_socket_data, &socket_transport);
+    if (!(client_socket_data->flags & SOCKET_FLAG_ZEROCOPY_PENDING))
+    {
+        close_client(loop, client_socket_data);
+    }
+    else if (client_socket_data->cold->zerocopy_completed != completed)
+    {
+        client_socket_data->cold->last_active_ms = monotonic_ms();
+    }
+}
+
+/**
+ * @brief Close the closing clients whose zerocopy sends made no progress for too long.
+ *
+ * The peer stopped acknowledging, so the connection is reset. Without the reset the kernel could
+ * keep transmitting from the buffer after it was freed and reused.
+ *
+ * @param[in] loop The event loop.
+ */
+void close_lingering_clients(EventLoop *loop)
+{
+    long long deadline_ms = monotonic_ms() - ZEROCOPY_LINGER_MS;
+    for (int i = 0; i < loop->client_socket_manager.size && loop->closing_clients > 0; i++)
+    {
+        SocketData *client_socket_data = get_socket(&loop->client_socket_manager, i);
+        if (client_socket_data->socket_fd == -1 || !(client_socket_data->flags & SOCKET_FLAG_CLOSING) ||
+            client_socket_data->cold->last_active_ms >= deadline_ms)
+        {
+            continue;
+        }
+
+        log_printf(LOG_LEVEL_INFO, "Resetting connection stuck on zerocopy sends (fd: %d)\n", client_socket_data->socket_fd);
+        struct linger linger = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(client_socket_data->socket_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close_client(loop, client_socket_data);
+    }
+}
+
+/**
+ * @brief Close the clients that have been idle for longer than the idle timeout.
+ *
+ * @param[in] loop The event loop.
+ */
+void close_idle_clients(EventLoop *loop)
+{
+    long long deadline_ms = monotonic_ms() - (long long)loop->config.idle_timeout * 1000;
+    for (int i = 0; i < loop->client_socket_manager.size; i++)
+    {
+        SocketData *client_socket_data = get_socket(&loop->client_socket_manager, i);
+        if (client_socket_data->socket_fd != -1 && !(client_socket_data->flags & SOCKET_FLAG_CLOSING) &&
+            client_socket_data->cold->last_active_ms < deadline_ms)
+        {
+            log_printf(LOG_LEVEL_INFO, "Closing idle connection (fd: %d)\n", client_socket_data->socket_fd);
+            close_client(loop, client_socket_data);
+        }
+    }
+}
+
+/**
+ * @brief Reload the configuration file and apply it to the running server.
+ *
+ * This function applies the new admission limits and log level, opens or closes listening sockets
+ * for added or removed ports, and passes the rest of the configuration on to every event loop.
+ * If the file is invalid, the current configuration is kept. The number of workers is only read
+ * at startup.
+ *
+ * @param[in] listen_socket_manager The socket manager for listening sockets.
+ * @return The status of the reload.
+ * @retval 0 The configuration was fully applied.
+ * @retval -1 The configuration could not be loaded or was only partially applied.
+ */
+int reload_config(SocketManager *listen_socket_manager)
+{
+    if (config_path == NULL)
+    {
+        puts("Received SIGHUP without a configuration file, ignoring");
+        return -1;
+    }
+
+    ServerConfig config;
+    if (load_config(config_path, &config) == -1)
+    {
+        puts("Failed to reload the configuration, keeping the current one");
+        return -1;
+    }
+
+    int result = 0;
+    if (config.port_count == 0)
+    {
+        // Keep listening rather than silently stop accepting connections
+        puts("No port in the configuration file, keeping the current listen sockets");
+        memcpy(config.ports, server_config.ports, sizeof(config.ports));
+        memcpy(config.port_profiles, server_config.port_profiles, sizeof(config.port_profiles));
+        config.port_count = server_config.port_count;
+        result = -1;
+    }
+    else if (update_listen_sockets(main_loop.epoll_fd, listen_socket_manager, &config) == -1)
+    {
+        result = -1;
+    }
+
+    if (config.workers != server_config.workers)
+    {
+        puts("The number of workers cannot be changed without a restart");
+        config.workers = server_config.workers;
+        result = -1;
+    }
+
+    admission_table.max_connections_per_ip = config.max_connections_per_ip;
+    admission_table.accept_rate = config.accept_rate;
+    admission_table.accept_burst = config.accept_burst;
+    log_level = config.log_level;
+
+    if (apply_config(&main_loop, &config, worker_count == 0 ? config.max_clients : -1) == -1)
+    {
+        result = -1;
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        ConfigUpdate *update;
+        if ((update = (ConfigUpdate *)malloc(sizeof(ConfigUpdate))) == NULL)
+        {
+            perror("server: malloc()");
+            result = -1;
+            continue;
+        }
+        update->loop = &workers[i];
+        update->config = config;
+        submit_task(&workers[i].task_queue, &update->task, apply_config_task, free, update);
+    }
+
+    server_config = config;
+    puts("Configuration reloaded");
+    return result;
+}
+
+/**
+ * @brief Apply a configuration to an event loop.
+ *
+ * Existing client connections are kept as they are, so a lower client limit or a different buffer
+ * size only affects new connections. A new buffer mode applies to existing connections once their
+ * pending data drains. It must run on the thread of the loop.
+ *
+ * @param[in] loop The event loop.
+ * @param[in] config The new configuration.
+ * @param[in] max_clients The number of clients the loop may serve, -1 if it serves none.
+ * @return The status of the process.
+ * @retval 0 The configuration was fully applied.
+ * @retval -1 Some settings could not be changed and were kept.
+ */
+int apply_config(EventLoop *loop, const ServerConfig *config, int max_clients)
+{
+    int result = 0;
+    ServerConfig applied = *config;
+
+    if (max_clients >= 0)
+    {
+        set_socket_manager_limit(&loop->client_socket_manager, max_clients);
+        if (grow_scratch_buffer(loop, config->buffer_size) == -1)
+        {
+            puts("Failed to grow the scratch buffer, keeping the current buffer size and mode");
+            applied.buffer_size = loop->config.buffer_size;
+            applied.buffer_mode = loop->config.buffer_mode;
+            result = -1;
+        }
+        loop->client_socket_manager.buffer_size = applied.buffer_size;
+        loop->client_socket_manager.lazy_buffers = applied.buffer_mode == BUFFER_MODE_LAZY;
+    }
+
+    if (config->max_events != loop->config.max_events)
+    {
+        struct epoll_event *new_events;
+        if ((new_events = (struct epoll_event *)realloc(loop->events, config->max_events * sizeof(struct epoll_event))) == NULL)
+        {
+            puts("Failed to change the maximum number of events, keeping the current one");
+            applied.max_events = loop->config.max_events;
+            result = -1;
+        }
+        else
+        {
+            loop->events = new_events;
+        }
+    }
+
+    loop->config = applied;
+    return result;
+}
+
+void apply_config_task(void *arg)
+{
+    ConfigUpdate *update = (ConfigUpdate *)arg;
+    apply_config(update->loop, &update->config, worker_max_clients(&update->config, update->loop->id - 1));
+    free(update);
+}
+
+/**
+ * @brief Get the number of clients an event loop may serve.
+ *
+ * The remainder of max_clients goes to the first workers, so the limits add up to max_clients.
+ *
+ * @param[in] config The configuration.
+ * @param[in] index The index of the worker in workers, 0 without workers.
+ * @return The client limit of the event loop, which may be 0 with more workers than clients.
+ */
+int worker_max_clients(const ServerConfig *config, int index)
+{
+    if (config->workers == 0)
+    {
+        return config->max_clients;
+    }
+    return config->max_clients / config->workers + (index < config->max_clients % config->workers ? 1 : 0);
+}
+
+/**
+ * @brief Get the port number of a socket address.
+ *
+ * @param[in] addr The socket address.
+ * @return The port number in host byte order, or -1 if the address family is not supported.
+ */
+int get_socket_port(const struct sockaddr_storage *addr)
+{
+    if (addr->ss_family == PF_INET)
+    {
+        return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+    }
+    if (addr->ss_family == PF_INET6)
+    {
+        return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+    }
+    return -1;
+}
+
+/**
+ * @brief Print the connection statistics of an event loop.
+ *
+ * @param[in] loop The event loop, it must be the loop of the calling thread.
+ */
+void print_stats(EventLoop *loop)
+{
+    int connections = 0;
+    unsigned long long bytes_received = 0;
+    unsigned long long bytes_sent = 0;
+    for (int i = 0; i < loop->client_socket_manager.size; i++)
+    {
+        SocketData *client_socket_data = get_socket(&loop->client_socket_manager, i);
+        if (client_socket_data->socket_fd == -1)
+        {
+            continue;
+        }
+        connections++;
+        bytes_received += client_socket_data->cold->bytes_received;
+        bytes_sent += client_socket_data->cold->bytes_sent;
+    }
+    printf("[loop %d] connections: %d, bytes_received: %llu, bytes_sent: %llu, bytes_in_flight: %llu\n", loop->id, connections, bytes_received, bytes_sent, loop->pending_bytes);
+    fflush(stdout);
+}
+
+void print_stats_task(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+    atomic_store(&loop->stats_requested, false);
+    print_stats(loop);
+}
+
+/**
+ * @brief Print the statistics of every event loop that serves clients.
+ *
+ * The memory footprint of the whole process is printed first, then each worker prints its own
+ * statistics on its thread.
+ */
+void request_stats(void)
+{
+    long long rss = resident_set_size();
+    int connections = atomic_load_explicit(&main_loop.connections, memory_order_relaxed);
+    for (int i = 0; i < worker_count; i++)
+    {
+        connections += atomic_load_explicit(&workers[i].connections, memory_order_relaxed);
+    }
+    if (rss != -1)
+    {
+        printf("[server] rss: %lld KiB, connections: %d\n", rss / 1024, connections);
+        fflush(stdout);
+    }
+
+    if (worker_count == 0)
+    {
+        print_stats(&main_loop);
+        return;
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        // A worker that has not printed the previous request yet prints once for both
+        if (!atomic_exchange(&workers[i].stats_requested, true))
+        {
+            submit_task(&workers[i].task_queue, &workers[i].stats_task, print_stats_task, NULL, &workers[i]);
         }
-        perror("server: write()");
-        exit(1);
     }
 }
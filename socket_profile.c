@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "socket_profile.h"
+#include "utils.h"
+
+const SocketProfile socket_profiles[SOCKET_PROFILE_COUNT] = {
+    [SOCKET_PROFILE_DEFAULT] = {
+        .listen_backlog = 5,
+    },
+    [SOCKET_PROFILE_LATENCY] = {
+        .listen_backlog = SOMAXCONN,
+        .defer_accept = 1,
+        .fastopen_qlen = 256,
+        .nodelay = true,
+        .quickack = true,
+        .notsent_lowat = 16384,
+    },
+    [SOCKET_PROFILE_BULK] = {
+        .listen_backlog = SOMAXCONN,
+        .defer_accept = 1,
+        .buffer_size = 4 * 1024 * 1024,
+    },
+};
+
+/**
+ * @brief Set an integer socket option, logging a failure instead of failing the socket.
+ *
+ * Tuning options are best effort: a kernel without one of them still serves the connection
+ * with its defaults.
+ *
+ * @param[in] socket_fd The file descriptor of the socket.
+ * @param[in] level The protocol level of the option.
+ * @param[in] option The option.
+ * @param[in] value The value of the option.
+ * @param[in] name The name of the option for the log.
+ */
+static void set_socket_option(int socket_fd, int level, int option, int value, const char *name)
+{
+    if (setsockopt(socket_fd, level, option, &value, sizeof(int)) == -1)
+    {
+        log_printf(LOG_LEVEL_ERROR, "server: setsockopt(%s): %s (fd: %d)\n", name, strerror(errno), socket_fd);
+    }
+}
+
+/**
+ * @brief Apply a socket profile to a listening socket.
+ *
+ * Must be called before listen(), the buffer sizes decide the window scale offered in the
+ * SYN-ACK and cannot be raised past it later.
+ *
+ * @param[in] listen_socket_fd The file descriptor of the listening socket.
+ * @param[in] profile The SOCKET_PROFILE_* to apply.
+ */
+void apply_listen_socket_profile(int listen_socket_fd, int profile)
+{
+    const SocketProfile *socket_profile = &socket_profiles[profile];
+    if (socket_profile->buffer_size > 0)
+    {
+        set_socket_option(listen_socket_fd, SOL_SOCKET, SO_RCVBUF, socket_profile->buffer_size, "SO_RCVBUF");
+        set_socket_option(listen_socket_fd, SOL_SOCKET, SO_SNDBUF, socket_profile->buffer_size, "SO_SNDBUF");
+    }
+    if (socket_profile->nodelay)
+    {
+        set_socket_option(listen_socket_fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (socket_profile->notsent_lowat > 0)
+    {
+        set_socket_option(listen_socket_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, socket_profile->notsent_lowat, "TCP_NOTSENT_LOWAT");
+    }
+    if (socket_profile->defer_accept > 0)
+    {
+        set_socket_option(listen_socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, socket_profile->defer_accept, "TCP_DEFER_ACCEPT");
+    }
+    if (socket_profile->fastopen_qlen > 0)
+    {
+        // Only takes effect when the net.ipv4.tcp_fastopen sysctl enables the server side (0x2)
+        set_socket_option(listen_socket_fd, IPPROTO_TCP, TCP_FASTOPEN, socket_profile->fastopen_qlen, "TCP_FASTOPEN");
+    }
+}
+
+/**
+ * @brief Apply the per-connection options of a socket profile to an accepted socket.
+ *
+ * TCP_QUICKACK only lasts until the kernel switches back to delayed ACKs on its own. It is not
+ * set again after every read since each echo already carries the ACK of the data it echoes.
+ *
+ * @param[in] conn_socket_fd The file descriptor of the connection socket.
+ * @param[in] profile The SOCKET_PROFILE_* of the listener that accepted the connection.
+ */
+void apply_client_socket_profile(int conn_socket_fd, int profile)
+{
+    if (socket_profiles[profile].quickack)
+    {
+        set_socket_option(conn_socket_fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+}
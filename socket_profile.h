@@ -0,0 +1,28 @@
+#include <stdbool.h>
+
+#ifndef SOCKET_PROFILE_H
+#define SOCKET_PROFILE_H
+
+#include "config.h"
+
+/**
+ * TCP options applied to the listeners of a port. Options set on a listening socket are
+ * inherited by the sockets it accepts on Linux, so only TCP_QUICKACK, which the kernel
+ * clears again on its own, has to be set per connection.
+ */
+typedef struct
+{
+    int listen_backlog;
+    int defer_accept;  // Seconds a connection may wait for its first data before it is accepted, 0 to accept on connect
+    int fastopen_qlen; // Pending TCP Fast Open connections, 0 to disable
+    bool nodelay;      // Disable Nagle's algorithm so small echoes are not held back
+    bool quickack;     // Start connections acknowledging data right away instead of delaying the ACK
+    int buffer_size;   // SO_RCVBUF and SO_SNDBUF, 0 to keep the kernel autotuning
+    int notsent_lowat; // Unsent bytes in the kernel before the socket stops being writable, 0 for the system default
+} SocketProfile;
+
+extern const SocketProfile socket_profiles[SOCKET_PROFILE_COUNT];
+
+void apply_listen_socket_profile(int listen_socket_fd, int profile);
+void apply_client_socket_profile(int conn_socket_fd, int profile);
+#endif
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "task_queue.h"
+#include "utils.h"
+
+int init_task_queue(TaskQueue *queue)
+{
+    if ((queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        perror("task_queue: eventfd()");
+        return -1;
+    }
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    atomic_init(&queue->wakeup_pending, 0);
+    queue->tail = &queue->stub;
+    return 0;
+}
+
+static void push_task(TaskQueue *queue, Task *task)
+{
+    atomic_store_explicit(&task->next, NULL, memory_order_relaxed);
+    Task *prev = atomic_exchange_explicit(&queue->head, task, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, task, memory_order_release);
+}
+
+/**
+ * @brief Pop the oldest task from the queue.
+ *
+ * A producer that has swapped the head but not yet linked its task makes the queue look empty
+ * for a moment. That producer wakes the loop again after it finishes, so nothing is lost.
+ *
+ * @param[in] queue The task queue.
+ * @return The oldest task, or NULL if there is none available yet.
+ */
+static Task *pop_task(TaskQueue *queue)
+{
+    Task *tail = queue->tail;
+    Task *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    // The tail is the last task, put the stub behind it so it can be detached
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+        return NULL;
+    }
+    push_task(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Submit a task to be run by the event loop that owns the queue.
+ *
+ * This function is safe to call from any thread and never fails. Only the first submission after
+ * the loop last drained the queue writes to the eventfd.
+ *
+ * @param[in] queue The task queue.
+ * @param[in] task The node of the task, usually embedded in arg. The queue is done with it as
+ * soon as the function is called, so the function may free it.
+ * @param[in] function The function to run on the loop thread.
+ * @param[in] discard The function releasing arg if the queue is freed before the task ran, or NULL.
+ * @param[in] arg The argument passed to the functions.
+ */
+void submit_task(TaskQueue *queue, Task *task, TaskFunction function, TaskFunction discard, void *arg)
+{
+    task->function = function;
+    task->discard = discard;
+    task->arg = arg;
+    push_task(queue, task);
+
+    if (atomic_exchange(&queue->wakeup_pending, 1) == 0)
+    {
+        wake_task_queue(queue);
+    }
+}
+
+/**
+ * @brief Wake up the event loop that owns the queue without submitting a task.
+ *
+ * @param[in] queue The task queue.
+ */
+void wake_task_queue(TaskQueue *queue)
+{
+    uint64_t value = 1;
+    while (write(queue->event_fd, &value, sizeof(value)) == -1)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        // EAGAIN means the counter is saturated, so the loop is going to wake up anyway
+        if (errno != EAGAIN)
+        {
+            perror("task_queue: write()");
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Run the tasks waiting in the queue.
+ *
+ * This function must only be called from the thread that owns the queue, when its eventfd is
+ * reported readable.
+ *
+ * @param[in] queue The task queue.
+ * @return The number of tasks that were run.
+ * @retval -1 An error occurred while reading the eventfd.
+ */
+int run_tasks(TaskQueue *queue)
+{
+    uint64_t value;
+    while (read(queue->event_fd, &value, sizeof(value)) == -1)
+    {
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        perror("task_queue: read()");
+        return -1;
+    }
+
+    // Re-arm the wakeup before draining, so a task submitted after the drain writes to the eventfd again
+    atomic_store(&queue->wakeup_pending, 0);
+
+    int count = 0;
+    Task *task;
+    while ((task = pop_task(queue)) != NULL)
+    {
+        // The task is detached from the queue, so the function may free the node along with its argument
+        task->function(task->arg);
+        count++;
+    }
+    return count;
+}
+
+void free_task_queue(TaskQueue *queue)
+{
+    if (queue->event_fd == -1)
+    {
+        return;
+    }
+
+    // Tasks that never ran are dropped, the submitter decided what their arguments still hold on to
+    Task *task;
+    while ((task = pop_task(queue)) != NULL)
+    {
+        if (task->discard != NULL)
+        {
+            task->discard(task->arg);
+        }
+    }
+    close_with_retry(queue->event_fd);
+    queue->event_fd = -1;
+}
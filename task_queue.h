@@ -0,0 +1,43 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include "utils.h"
+
+typedef void (*TaskFunction)(void *arg);
+
+/**
+ * A queued task. The submitter provides the node, usually embedded in the argument, so the queue
+ * itself never allocates. It must stay valid and must not be submitted again until the task has run.
+ */
+typedef struct Task
+{
+    struct Task *_Atomic next;
+    TaskFunction function;
+    TaskFunction discard; // Run instead of function when the queue is freed first, NULL if there is nothing to release
+    void *arg;
+} Task;
+
+/**
+ * Lock-free multi-producer single-consumer queue of tasks for an event loop.
+ * Any thread may submit tasks, only the thread running the loop may run them.
+ * The eventfd becomes readable when tasks are waiting, and submissions made
+ * before the loop gets to them are coalesced into a single wakeup.
+ */
+typedef struct
+{
+    _Alignas(CACHE_LINE_SIZE) Task *_Atomic head; // Written by producers
+    atomic_int wakeup_pending;
+    _Alignas(CACHE_LINE_SIZE) Task *tail; // Only touched by the consumer
+    Task stub;
+    int event_fd;
+} TaskQueue;
+
+int init_task_queue(TaskQueue *queue);
+void submit_task(TaskQueue *queue, Task *task, TaskFunction function, TaskFunction discard, void *arg);
+int run_tasks(TaskQueue *queue);
+void wake_task_queue(TaskQueue *queue);
+void free_task_queue(TaskQueue *queue);
+#endif
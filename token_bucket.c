@@ -0,0 +1,64 @@
+#include "token_bucket.h"
+
+void token_bucket_init(TokenBucket *bucket, unsigned int burst, long long now_ms)
+{
+    bucket->milli_tokens = (unsigned long long)burst * 1000;
+    bucket->last_refill_ms = now_ms;
+}
+
+/**
+ * @brief Refill the bucket for the time elapsed since the last refill.
+ *
+ * @param[in] bucket The token bucket.
+ * @param[in] rate The number of tokens added per second, 0 for unlimited.
+ * @param[in] burst The maximum number of tokens the bucket can hold.
+ * @param[in] now_ms The current monotonic time in milliseconds.
+ * @return The number of whole tokens available, or ~0U if the rate is unlimited.
+ */
+unsigned int token_bucket_refill(TokenBucket *bucket, unsigned int rate, unsigned int burst, long long now_ms)
+{
+    if (rate == 0)
+    {
+        return ~0U;
+    }
+
+    unsigned long long capacity = (unsigned long long)burst * 1000;
+    if (now_ms > bucket->last_refill_ms)
+    {
+        bucket->milli_tokens += (unsigned long long)(now_ms - bucket->last_refill_ms) * rate;
+        if (bucket->milli_tokens > capacity)
+        {
+            bucket->milli_tokens = capacity;
+        }
+        bucket->last_refill_ms = now_ms;
+    }
+    return (unsigned int)(bucket->milli_tokens / 1000);
+}
+
+void token_bucket_take(TokenBucket *bucket, unsigned int tokens)
+{
+    unsigned long long milli_tokens = (unsigned long long)tokens * 1000;
+    bucket->milli_tokens = bucket->milli_tokens > milli_tokens ? bucket->milli_tokens - milli_tokens : 0;
+}
+
+/**
+ * @brief Get the time at which the bucket will be full again.
+ *
+ * Tokens that arrive after that are lost, so a reader held back by the bucket should be resumed
+ * by then to get the whole rate.
+ *
+ * @param[in] bucket The token bucket.
+ * @param[in] rate The number of tokens added per second, 0 for unlimited.
+ * @param[in] burst The maximum number of tokens the bucket can hold.
+ * @return The monotonic time in milliseconds, the time of the last refill if it is already full or
+ * the rate is unlimited.
+ */
+long long token_bucket_full_at_ms(const TokenBucket *bucket, unsigned int rate, unsigned int burst)
+{
+    unsigned long long capacity = (unsigned long long)burst * 1000;
+    if (rate == 0 || bucket->milli_tokens >= capacity)
+    {
+        return bucket->last_refill_ms;
+    }
+    return bucket->last_refill_ms + (long long)((capacity - bucket->milli_tokens + rate - 1) / rate);
+}
@@ -0,0 +1,18 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+/**
+ * Token bucket counted in milli-tokens so that integer refills do not lose
+ * fractions when it is checked more often than once per token.
+ */
+typedef struct
+{
+    unsigned long long milli_tokens;
+    long long last_refill_ms;
+} TokenBucket;
+
+void token_bucket_init(TokenBucket *bucket, unsigned int burst, long long now_ms);
+unsigned int token_bucket_refill(TokenBucket *bucket, unsigned int rate, unsigned int burst, long long now_ms);
+void token_bucket_take(TokenBucket *bucket, unsigned int tokens);
+long long token_bucket_full_at_ms(const TokenBucket *bucket, unsigned int rate, unsigned int burst);
+#endif
@@ -1,73 +1,206 @@
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "utils.h"
 
-void init_socket_manager(SocketManager *manager, int max_size)
+atomic_int log_level = LOG_LEVEL_INFO;
+
+int init_socket_manager(SocketManager *manager, int max_size, unsigned int buffer_size)
+{
+    // Pages and the descriptor index are allocated as sockets are added
+    memset(manager, 0, sizeof(*manager));
+    manager->limit = max_size;
+    manager->free_head = -1;
+    manager->buffer_size = buffer_size;
+    return 0;
+}
+
+/**
+ * @brief Allocate one more page of the socket table and put its slots on the free list.
+ *
+ * @param[in] manager The socket manager.
+ * @return The status of the process.
+ * @retval 0 The page was successfully added.
+ * @retval -1 The page could not be allocated.
+ */
+static int add_socket_page(SocketManager *manager)
+{
+    SocketPage **pages;
+    if ((pages = (SocketPage **)realloc(manager->pages, (manager->page_count + 1) * sizeof(SocketPage *))) == NULL)
+    {
+        return -1;
+    }
+    manager->pages = pages;
+
+    SocketPage *page;
+    if ((page = (SocketPage *)aligned_alloc(_Alignof(SocketPage), sizeof(SocketPage))) == NULL)
+    {
+        return -1;
+    }
+    manager->pages[manager->page_count++] = page;
+
+    // Push the slots in reverse so that the lowest one is handed out first
+    for (int i = SOCKET_PAGE_SIZE - 1; i >= 0; i--)
+    {
+        page->sockets[i].socket_fd = -1;
+        page->sockets[i].flags = 0;
+        page->sockets[i].pending_len = 0;
+        page->sockets[i].buffer_size = 0;
+        page->sockets[i].buffer = NULL;
+        page->sockets[i].cold = &page->cold_data[i];
+        page->cold_data[i].next_free = manager->free_head;
+        manager->free_head = manager->size + i;
+    }
+    manager->size += SOCKET_PAGE_SIZE;
+    return 0;
+}
+
+/**
+ * @brief Grow the descriptor index so that it covers a file descriptor.
+ *
+ * @param[in] manager The socket manager.
+ * @param[in] socket_fd The file descriptor.
+ * @return The status of the process.
+ * @retval 0 The index covers the file descriptor.
+ * @retval -1 The index could not be grown.
+ */
+static int grow_fd_index(SocketManager *manager, int socket_fd)
 {
-    manager->sockets = (SocketData *)malloc(max_size * sizeof(SocketData));
-    manager->free_indices = (int *)malloc(max_size * sizeof(int));
-    manager->max_size = max_size;
-    manager->top = max_size - 1;
+    int size = manager->fd_index_size > 0 ? manager->fd_index_size : SOCKET_PAGE_SIZE;
+    while (size <= socket_fd)
+    {
+        size *= 2;
+    }
 
-    for (int i = 0; i < max_size; i++)
+    int *fd_index;
+    if ((fd_index = (int *)realloc(manager->fd_index, size * sizeof(int))) == NULL)
     {
-        manager->sockets[i].socket_fd = -1;
-        manager->free_indices[i] = i;
+        return -1;
     }
+    for (int i = manager->fd_index_size; i < size; i++)
+    {
+        fd_index[i] = -1;
+    }
+    manager->fd_index = fd_index;
+    manager->fd_index_size = size;
+    return 0;
+}
+
+SocketData *get_socket(SocketManager *manager, int index)
+{
+    return &manager->pages[index / SOCKET_PAGE_SIZE]->sockets[index % SOCKET_PAGE_SIZE];
 }
 
 SocketData *find_socket(SocketManager *manager, int socket_fd)
 {
-    for (int i = 0; i < manager->max_size; i++)
+    if (socket_fd < 0 || socket_fd >= manager->fd_index_size || manager->fd_index[socket_fd] == -1)
     {
-        if (manager->sockets[i].socket_fd == socket_fd)
-        {
-            return &manager->sockets[i];
-        }
+        return NULL;
     }
-    return NULL;
+    return get_socket(manager, manager->fd_index[socket_fd]);
 }
 
 int add_socket(SocketManager *manager, int socket_fd)
 {
-    if (manager->top < 0)
+    if (socket_fd < 0 || manager->count >= manager->limit)
+    {
+        return -1;
+    }
+    if (manager->free_head == -1 && add_socket_page(manager) == -1)
+    {
+        return -1;
+    }
+    if (socket_fd >= manager->fd_index_size && grow_fd_index(manager, socket_fd) == -1)
     {
         return -1;
     }
-    int index = manager->free_indices[manager->top--];
-    manager->sockets[index].socket_fd = socket_fd;
+
+    int index = manager->free_head;
+    SocketData *socket_data = get_socket(manager, index);
+    if (manager->buffer_size > 0 && !manager->lazy_buffers)
+    {
+        if ((socket_data->buffer = (char *)malloc(manager->buffer_size)) == NULL)
+        {
+            return -1;
+        }
+    }
+    socket_data->buffer_size = manager->buffer_size;
+    manager->free_head = socket_data->cold->next_free;
+    manager->fd_index[socket_fd] = index;
+    manager->count++;
+
+    socket_data->socket_fd = socket_fd;
+    socket_data->flags = 0;
+    socket_data->pending_len = 0;
+    memset(socket_data->cold, 0, sizeof(SocketColdData));
     return index;
 }
 
 int remove_socket(SocketManager *manager, int socket_fd)
 {
-    for (int i = 0; i < manager->max_size; i++)
+    if (socket_fd < 0 || socket_fd >= manager->fd_index_size || manager->fd_index[socket_fd] == -1)
     {
-        if (manager->sockets[i].socket_fd == socket_fd)
-        {
-            manager->sockets[i].socket_fd = -1;
-            manager->free_indices[++manager->top] = i;
-            return 0;
-        }
+        return -1;
     }
-    return -1;
+
+    int index = manager->fd_index[socket_fd];
+    SocketData *socket_data = get_socket(manager, index);
+    socket_data->socket_fd = -1;
+    free(socket_data->buffer);
+    socket_data->buffer = NULL;
+    socket_data->buffer_size = 0;
+    socket_data->pending_len = 0;
+    socket_data->cold->next_free = manager->free_head;
+    manager->free_head = index;
+    manager->fd_index[socket_fd] = -1;
+    manager->count--;
+    return 0;
 }
 
 int close_all_sockets(SocketManager *manager)
 {
-    for (int i = 0; i < manager->max_size; i++)
+    for (int i = 0; i < manager->size; i++)
     {
-        if (manager->sockets[i].socket_fd != -1)
+        SocketData *socket_data = get_socket(manager, i);
+        if (socket_data->socket_fd != -1)
         {
-            close_with_retry(manager->sockets[i].socket_fd);
+            close_with_retry(socket_data->socket_fd);
         }
+        free(socket_data->buffer);
     }
-    free(manager->sockets);
-    free(manager->free_indices);
+    for (int i = 0; i < manager->page_count; i++)
+    {
+        free(manager->pages[i]);
+    }
+    free(manager->pages);
+    free(manager->fd_index);
+    memset(manager, 0, sizeof(*manager));
+    manager->free_head = -1;
+    return 0;
+}
+
+/**
+ * @brief Change the maximum number of sockets in use.
+ *
+ * Sockets that are already in use are never dropped. Lowering the limit only stops new sockets
+ * from being added, and the table grows a page at a time as sockets are added under a higher one.
+ * Nothing is reallocated here, so a reload can never leave the cold pointers of the sockets in
+ * use pointing into freed memory, and a page that fails to allocate leaves the table as it was.
+ *
+ * @param[in] manager The socket manager.
+ * @param[in] limit The new maximum number of sockets in use.
+ * @return The status of the process.
+ * @retval 0 The limit was successfully changed.
+ */
+int set_socket_manager_limit(SocketManager *manager, int limit)
+{
+    manager->limit = limit;
     return 0;
 }
 
@@ -96,3 +229,41 @@ int close_with_retry(int fd)
     }
     return 0;
 }
+
+long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long resident_set_size(void)
+{
+    FILE *file;
+    if ((file = fopen("/proc/self/statm", "r")) == NULL)
+    {
+        return -1;
+    }
+    long long size_pages;
+    long long resident_pages;
+    int matched = fscanf(file, "%lld %lld", &size_pages, &resident_pages);
+    fclose(file);
+    if (matched != 2)
+    {
+        return -1;
+    }
+    return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+void log_printf(int level, const char *format, ...)
+{
+    if (level > atomic_load_explicit(&log_level, memory_order_relaxed))
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
@@ -1,30 +1,101 @@
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <sys/socket.h>
 
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "token_bucket.h"
+
 #define BUFFER_SIZE 256
+#define CACHE_LINE_SIZE 64
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+
+#define SOCKET_FLAG_EPOLLIN 0x1   // The socket is registered for EPOLLIN
+#define SOCKET_FLAG_EPOLLOUT 0x2  // The socket is registered for EPOLLOUT
+#define SOCKET_FLAG_THROTTLED 0x4 // Reading is paused until the byte bucket refills
+#define SOCKET_FLAG_ZEROCOPY 0x8  // Large sends may use MSG_ZEROCOPY
+#define SOCKET_FLAG_ZEROCOPY_PENDING 0x10 // The start of the buffer is pinned by zerocopy sends in flight
+#define SOCKET_FLAG_CLOSING 0x20 // Closed by the server, the socket and buffer are kept until the zerocopy sends complete
+#define SOCKET_FLAG_ADMITTED 0x40 // Counted in the admission table, so the close releases it
+
+#define SOCKET_PAGE_SIZE 64 // Sockets per page of the socket table
+
+/**
+ * Cold per-connection data. It is only touched on accept, on close and when
+ * statistics are updated, so it lives outside the array scanned on every event.
+ */
+typedef struct
+{
+    struct sockaddr_storage addr; // Peer address for client sockets, bound address for listen sockets
+    socklen_t addr_len;
+    unsigned long long bytes_received;
+    unsigned long long bytes_sent;
+    long long last_active_ms;
+    TokenBucket byte_bucket;
+    unsigned int sent_offset;        // Bytes at the start of the buffer already sent but still pinned
+    unsigned int zerocopy_issued;    // Number of MSG_ZEROCOPY sends, the kernel numbers them the same way
+    unsigned int zerocopy_completed; // Number of MSG_ZEROCOPY sends the kernel has released
+    void *admission_record;          // Handed back to the acceptor on close to release the admission count, NULL if none
+    int next_free;                   // Next slot of the free list while the slot is unused, -1 at the end
+} SocketColdData;
 
+/**
+ * Hot per-connection data. Kept at 32 bytes so two records share a cache line
+ * and scanning the socket array touches as few lines as possible.
+ */
 typedef struct
 {
     int socket_fd;
-    char buffer[BUFFER_SIZE]; // TODO: Use dynamic memory allocation for the buffer
+    unsigned int flags;
+    unsigned int pending_len; // Number of bytes in the buffer waiting to be sent
+    unsigned int buffer_size;
+    char *buffer;             // NULL while a lazily buffered socket has nothing pending
+    SocketColdData *cold;
 } SocketData;
 
+_Static_assert(CACHE_LINE_SIZE % sizeof(SocketData) == 0, "SocketData must evenly divide a cache line");
+
+/**
+ * A page of the socket table. Pages are allocated as sockets are added and
+ * never move, so SocketData pointers stay valid while the table grows.
+ */
+typedef struct
+{
+    _Alignas(CACHE_LINE_SIZE) SocketData sockets[SOCKET_PAGE_SIZE];
+    SocketColdData cold_data[SOCKET_PAGE_SIZE];
+} SocketPage;
+
 typedef struct
 {
-    SocketData *sockets;
-    int *free_indices;
-    int max_size;
-    int top;
+    SocketPage **pages;
+    int page_count;
+    int size;                 // Number of slots in the allocated pages
+    int count;                // Number of sockets in use
+    int limit;                // Maximum number of sockets in use
+    int free_head;            // First slot of the free list, -1 if every slot is in use
+    int *fd_index;            // Slot of each file descriptor, -1 if it is not in the table
+    int fd_index_size;
+    unsigned int buffer_size; // Buffer size given to new sockets, 0 for no buffer
+    bool lazy_buffers;        // Allocate buffers only while data is pending instead of up front
 } SocketManager;
 
-void init_socket_manager(SocketManager *manager, int max_size);
+extern atomic_int log_level;
+
+int init_socket_manager(SocketManager *manager, int max_size, unsigned int buffer_size);
+SocketData *get_socket(SocketManager *manager, int index);
 SocketData *find_socket(SocketManager *manager, int socket_fd);
 int add_socket(SocketManager *manager, int socket_fd);
 int remove_socket(SocketManager *manager, int socket_fd);
 int close_all_sockets(SocketManager *manager);
+int set_socket_manager_limit(SocketManager *manager, int limit);
 
 int parse_port(const char *port_str);
 int close_with_retry(int fd);
+long long monotonic_ms(void);
+long long resident_set_size(void);
+void log_printf(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
 #endif